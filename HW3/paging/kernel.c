@@ -16,6 +16,62 @@ int VIRTUAL_SPACE_SIZE = 512;
 int PAGE_SIZE = 32;
 int MAX_PROCESS_NUM = 8;
 
+// Put the free block of the given order starting at page pfn on its free list.
+static void buddy_push(struct BuddyAllocator * buddy, int pfn, int order) {
+	buddy->order[pfn] = order;
+	buddy->prev[pfn] = -1;
+	buddy->next[pfn] = buddy->free_lists[order];
+	if(buddy->free_lists[order] != -1)
+		buddy->prev[buddy->free_lists[order]] = pfn;
+	buddy->free_lists[order] = pfn;
+}
+
+// Take the free block starting at page pfn off its free list.
+static void buddy_remove(struct BuddyAllocator * buddy, int pfn) {
+	if(buddy->prev[pfn] != -1)
+		buddy->next[buddy->prev[pfn]] = buddy->next[pfn];
+	else
+		buddy->free_lists[buddy->order[pfn]] = buddy->next[pfn];
+	if(buddy->next[pfn] != -1)
+		buddy->prev[buddy->next[pfn]] = buddy->prev[pfn];
+	buddy->order[pfn] = -1;
+}
+
+// Take a block of 2^order free pages and return its first page, -1 if there is none.
+// A larger block is split in halves, the first half kept and the second freed, until it has the order.
+static int alloc_pages(struct Kernel * kernel, int order) {
+	struct BuddyAllocator * buddy = &kernel->buddy;
+	int k = order;
+	while(k <= BUDDY_MAX_ORDER && buddy->free_lists[k] == -1)
+		k++;
+	if(k > BUDDY_MAX_ORDER)
+		return -1;
+	int pfn = buddy->free_lists[k];
+	buddy_remove(buddy, pfn);
+	while(k > order) {
+		k--;
+		buddy_push(buddy, pfn + (1 << k), k);
+	}
+	memset(kernel->occupied_pages + pfn, 1, 1 << order);
+	return pfn;
+}
+
+// Free a page, and merge it with its buddy while the buddy is a free block of the same order.
+static void free_page(struct Kernel * kernel, int pfn) {
+	struct BuddyAllocator * buddy = &kernel->buddy;
+	kernel->occupied_pages[pfn] = 0;
+	int k = 0;
+	while(k < BUDDY_MAX_ORDER) {
+		int buddy_pfn = pfn ^ (1 << k);
+		if(buddy_pfn >= KERNEL_SPACE_SIZE / PAGE_SIZE || buddy->order[buddy_pfn] != k)
+			break;
+		buddy_remove(buddy, buddy_pfn);
+		pfn &= ~(1 << k);
+		k++;
+	}
+	buddy_push(buddy, pfn, k);
+}
+
 // The kernel managed memory content is set to 0 initiallly.
 struct Kernel * init_kernel() {
 	struct Kernel * kernel = (struct Kernel *)malloc(sizeof(struct Kernel));
@@ -33,12 +89,31 @@ struct Kernel * init_kernel() {
 	memset(kernel->occupied_pages, 0, sizeof(char) * KERNEL_SPACE_SIZE / PAGE_SIZE);
 	memset(kernel->running, 0, sizeof(char) * MAX_PROCESS_NUM);
 
+	// All pages start free, in the largest aligned blocks that fit.
+	int num_pages = KERNEL_SPACE_SIZE / PAGE_SIZE;
+	kernel->buddy.next = (int *)malloc(sizeof(int) * num_pages);
+	kernel->buddy.prev = (int *)malloc(sizeof(int) * num_pages);
+	kernel->buddy.order = (signed char *)malloc(sizeof(signed char) * num_pages);
+	memset(kernel->buddy.order, -1, num_pages);
+	for(int k = 0; k <= BUDDY_MAX_ORDER; k ++)
+		kernel->buddy.free_lists[k] = -1;
+	for(int pfn = 0; pfn < num_pages; ) {
+		int k = BUDDY_MAX_ORDER;
+		while(pfn % (1 << k) != 0 || pfn + (1 << k) > num_pages)
+			k--;
+		buddy_push(&kernel->buddy, pfn, k);
+		pfn += 1 << k;
+	}
+
 	return kernel;
 }
 
 void destroy_kernel(struct Kernel * kernel) {
 	free(kernel->space);
 	free(kernel->occupied_pages);
+	free(kernel->buddy.next);
+	free(kernel->buddy.prev);
+	free(kernel->buddy.order);
 	free(kernel->running);
 	for(int i = 0; i < MAX_PROCESS_NUM; i ++){
 		if(kernel->mm[i].page_table != NULL)
@@ -157,45 +232,54 @@ int proc_create_vm(struct Kernel * kernel, int size) {
 	
 }
 
+// Map the pages of a process in [addr, addr+size) that are not present to pages taken from the buddy allocator.
+// Return 0 when success, -1 when kernel-managed memory is full (the pages mapped so far stay mapped).
+static int map_pages(struct Kernel * kernel, int pid, long addr, int size) {
+	for(long i = addr / PAGE_SIZE; i <= (addr + size - 1) / PAGE_SIZE; i++) {
+		struct PTE * pte = &kernel->mm[pid].page_table[i];
+		if(pte->present == 1)
+			continue;
+		int pfn = alloc_pages(kernel, 0);
+		if(pfn == -1)
+			return -1;
+		pte->PFN = pfn;
+		pte->present = 1;
+	}
+	return 0;
+}
+
+// Copy between buf and the pages of a process in [addr, addr+size), which are present: from buf when write is 1.
+static void copy_pages(struct Kernel * kernel, int pid, long addr, int size, char * buf, int write) {
+	while(size > 0) {
+		int offset = addr % PAGE_SIZE;
+		int n = min(size, PAGE_SIZE - offset);
+		char * page = kernel->space + (long)kernel->mm[pid].page_table[addr / PAGE_SIZE].PFN * PAGE_SIZE;
+		if(write)
+			memcpy(page + offset, buf, n);
+		else
+			memcpy(buf, page + offset, n);
+		addr += n;
+		buf += n;
+		size -= n;
+	}
+}
+
 /*
 	This function will read the range [addr, addr+size) from user space of a specific process to the buf (buf should be >= size).
 	1. Check if the reading range is out-of-bounds.
 	2. If the pages in the range [addr, addr+size) of the user space of that process are not present,
-	   you should firstly map them to the free kernel-managed memory pages (first fit policy).
-	Return 0 when success, -1 when failure (out of bounds).
+	   you should firstly map them to the free kernel-managed memory pages (taken from the buddy allocator).
+	3. Each page is read from the page of kernel-managed memory it is mapped to (its PFN).
+	Return 0 when success, -1 when failure (out of bounds, or kernel-managed memory is full).
 */
 int vm_read(struct Kernel * kernel, int pid, char * addr, int size, char * buf) {
-	if(pid > MAX_PROCESS_NUM || kernel->running[pid] == 0 || (uintptr_t)(addr) + (uintptr_t)(size) > (uintptr_t)(kernel->mm[pid].size))
+	if(pid < 0 || pid >= MAX_PROCESS_NUM || kernel->running[pid] == 0 || size < 0 || (uintptr_t)(addr) + (uintptr_t)(size) > (uintptr_t)(kernel->mm[pid].size))
 		return -1;
-	
-
-	int fake_addr = (long)addr/PAGE_SIZE;
-	int final_pos = (size+(long)addr+1)/PAGE_SIZE;
-
-	//printf("fake_addr = %d\n", fake_addr);
-	//printf("final_pos = %d\n\n", final_pos);
-	for(int i = fake_addr; i < final_pos+1; i++)
-	{
-		//for i=fake_address to number of page_table
-		if(kernel->mm[pid].page_table[i].present == 0)
-		{
-			//map them until found the free kernel-managed memory pages
-			for(int j=0; j< (KERNEL_SPACE_SIZE / PAGE_SIZE) ; j++)
-			{
-				if(kernel->occupied_pages[j] == 0)
-				{
-					kernel->occupied_pages[j] = 1;  
-					kernel->mm[pid].page_table[i].PFN = j;  //set the page_table
-					break;
-				}				
-			}
-			kernel->mm[pid].page_table[i].present = 1;
-		}
-	}
-	//printf("size before = %d\n", size);
-	//size = (final_pos-fake_addr+1)*PAGE_SIZE;
-	//printf("size after = %d\n\n", size);
-	memcpy(buf, kernel->space + (uintptr_t)(addr), size); //don't know if correct
+	if(size == 0)
+		return 0;
+	if(map_pages(kernel, pid, (long)addr, size) == -1)
+		return -1;
+	copy_pages(kernel, pid, (long)addr, size, buf, 0);
 	return 0;
 }
 
@@ -203,63 +287,41 @@ int vm_read(struct Kernel * kernel, int pid, char * addr, int size, char * buf)
 	This function will write the content of buf to user space [addr, addr+size) (buf should be >= size).
 	1. Check if the writing range is out-of-bounds.
 	2. If the pages in the range [addr, addr+size) of the user space of that process are not present,
-	   you should firstly map them to the free kernel-managed memory pages (first fit policy).
-	Return 0 when success, -1 when failure (out of bounds).
+	   you should firstly map them to the free kernel-managed memory pages (taken from the buddy allocator).
+	3. Each page is written to the page of kernel-managed memory it is mapped to (its PFN).
+	Return 0 when success, -1 when failure (out of bounds, or kernel-managed memory is full).
 */
 int vm_write(struct Kernel * kernel, int pid, char * addr, int size, char * buf){
-	
-	if(pid > MAX_PROCESS_NUM || kernel->running[pid] == 0 || (uintptr_t)(addr) + (uintptr_t)(size) > (uintptr_t)(kernel->mm[pid].size))
+	if(pid < 0 || pid >= MAX_PROCESS_NUM || kernel->running[pid] == 0 || size < 0 || (uintptr_t)(addr) + (uintptr_t)(size) > (uintptr_t)(kernel->mm[pid].size))
 		return -1;
-
-
-	int fake_addr = (long)(addr)/PAGE_SIZE;
-	int final_pos = (size+(long)addr+1)/PAGE_SIZE;
-
-	//printf("fake_addr = %d\n", fake_addr);
-	//printf("final_pos = %d\n\n", final_pos);
-	for(int i = fake_addr; i < final_pos; i++)
-	{
-		//for i=fake_address to number of page_table
-		if(kernel->mm[pid].page_table[i].present == 0)
-		{
-			//map them until found the free kernel-managed memory pages
-			for(int j=0; j< (KERNEL_SPACE_SIZE / PAGE_SIZE) ; j++)
-			{
-				if(kernel->occupied_pages[j] == 0)
-				{
-					kernel->occupied_pages[j] = 1;  
-					kernel->mm[pid].page_table[i].PFN = j;  //set the page_table
-					break;
-				}				
-			}
-			kernel->mm[pid].page_table[i].present = 1;
-		}
-	}
-
-	memcpy(kernel->space + (uintptr_t)(addr), buf, size);
-	return  0;
+	if(size == 0)
+		return 0;
+	if(map_pages(kernel, pid, (long)addr, size) == -1)
+		return -1;
+	copy_pages(kernel, pid, (long)addr, size, buf, 1);
+	return 0;
 }
 
 /*
 	This function will free the space of a process.
-	1. Reset the corresponding pages in occupied_pages to 0.
+	1. Return the corresponding pages to the buddy allocator (which resets them in occupied_pages to 0).
 	2. Release the page_table in the corresponding MMStruct and set to NULL.
+	3. Mark the process as not running and give back its pages in allocated_pages, so the slot can be reused.
 	Return 0 when success, -1 when failure.
 */
 int proc_exit_vm(struct Kernel * kernel, int pid){
-	// Fill your codes below.
-	if(pid > MAX_PROCESS_NUM || kernel->running[pid] == 0)
+	if(pid < 0 || pid >= MAX_PROCESS_NUM || kernel->running[pid] == 0)
 		return -1;
 
-	for(int i=0; i<kernel->mm[pid].size/PAGE_SIZE;i++)
+	int num_pages = (kernel->mm[pid].size + PAGE_SIZE - 1) / PAGE_SIZE;
+	for(int i = 0; i < num_pages; i++)
 	{
-		//check present = 1;
-		//take the PFN;
-		if(kernel->mm[pid].page_table[i].present==1)
-		{
-			kernel->occupied_pages[kernel->mm[pid].page_table[i].PFN]=0;
-		}
+		if(kernel->mm[pid].page_table[i].present == 1 && kernel->mm[pid].page_table[i].PFN != -1)
+			free_page(kernel, kernel->mm[pid].page_table[i].PFN);
 	}
 	free(kernel->mm[pid].page_table);
+	kernel->mm[pid].page_table = NULL;
+	kernel->running[pid] = 0;
+	kernel->allocated_pages -= num_pages;
 	return 0;
 }
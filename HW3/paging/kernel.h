@@ -29,11 +29,27 @@ struct MMStruct {
 	struct PTE * page_table;
 };
 
+/*
+	A binary buddy allocator over the pages of kernel-managed memory. A free block of order k is 2^k pages starting
+	at a multiple of 2^k, and is on free_lists[k]. A freed page is merged with its buddy (the other half of the block
+	of order k+1 it belongs to) while the buddy is free too, so a run of 2^k contiguous pages is taken from the
+	first list with a block of order >= k, without searching occupied_pages.
+*/
+#define BUDDY_MAX_ORDER 9
+
+struct BuddyAllocator {
+	int free_lists[BUDDY_MAX_ORDER + 1]; // The first page of the first free block of each order, -1 if none.
+	int * next;                          // For the first page of a free block, the first pages of the next and
+	int * prev;                          // previous free blocks of its order (-1 if none).
+	signed char * order;                 // For each page, the order of the free block it is the first page of, -1 if none.
+};
+
 // The Kernel manages MAX_PROCESS_NUM of processes.
 struct Kernel {
 	char * space;
 	int allocated_pages;   // The number of allocated pages for processes.
 	char * occupied_pages; // For simplicity, we use a char array to indicate the free pages, 0 for free, 1 for occupied.
+	struct BuddyAllocator buddy; // The free pages, in blocks. occupied_pages is kept for printing.
 	char * running;        // An array marking if the process is running.
 	struct MMStruct * mm;  // An array of MMStruct for each process.
 };
@@ -57,8 +73,9 @@ int proc_create_vm(struct Kernel * kernel, int size);
 	This function will read the range [addr, addr+size) from user space of a specific process to the buf (buf should be >= size).
 	1. Check if the reading range is out-of-bounds.
 	2. If the pages in the range [addr, addr+size) of the user space of that process are not present,
-	   you should firstly map them to the free kernel-managed memory pages (first fit policy).
-	Return 0 when success, -1 when failure (out of bounds).
+	   you should firstly map them to the free kernel-managed memory pages (taken from the buddy allocator).
+	3. Each page is read from the page of kernel-managed memory it is mapped to (its PFN).
+	Return 0 when success, -1 when failure (out of bounds, or kernel-managed memory is full).
 */
 int vm_read(struct Kernel * kernel, int pid, char * addr, int size, char * buf);
 
@@ -66,15 +83,17 @@ int vm_read(struct Kernel * kernel, int pid, char * addr, int size, char * buf);
 	This function will write the content of buf to user space [addr, addr+size) (buf should be >= size).
 	1. Check if the writing range is out-of-bounds.
 	2. If the pages in the range [addr, addr+size) of the user space of that process are not present,
-	   you should firstly map them to the free kernel-managed memory pages (first fit policy).
-	Return 0 when success, -1 when failure (out of bounds).
+	   you should firstly map them to the free kernel-managed memory pages (taken from the buddy allocator).
+	3. Each page is written to the page of kernel-managed memory it is mapped to (its PFN).
+	Return 0 when success, -1 when failure (out of bounds, or kernel-managed memory is full).
 */
 int vm_write(struct Kernel * kernel, int pid, char * addr, int size, char * buf);
 
 /*
 	This function will free the space of a process.
-	1. Reset the corresponding pages in occupied_pages to 0.
+	1. Return the corresponding pages to the buddy allocator (which resets them in occupied_pages to 0).
 	2. Release the page_table in the corresponding MMStruct and set to NULL.
+	3. Mark the process as not running and give back its pages in allocated_pages, so the slot can be reused.
 	Return 0 when success, -1 when failure.
 */
 int proc_exit_vm(struct Kernel * kernel, int pid);
\ No newline at end of file
@@ -0,0 +1,418 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+        Analyze a memory access trace (the format of bench.c, "r|w pid addr size" per line) for the page size and
+        the size of kernel-managed memory of the paging kernel:
+        1. The misses of Belady's optimal replacement (OPT), which evicts the resident page used again furthest in the future.
+        2. The LRU miss ratio curve for every memory size at once, from the LRU stack distance of each access.
+        3. The working set size of each process: the distinct pages it accessed in each window of -W accesses.
+        The trace is read once. Its page ids are spilled to temporary files for the backward pass OPT needs, so memory
+        grows with the number of distinct pages, not with the length of the trace.
+
+        ./Analyze [-p PAGE_SIZE (4096)] [-k KERNEL_SPACE_SIZE (1 MiB)] [-W window (100000)] [-q] FILE
+                -q  do not print the working set of every window, only its mean and maximum per process.
+*/
+
+#define BLOCK_ENTRIES (1 << 20) // Accesses read or written at once in the temporary files.
+#define NEVER INT64_MAX         // The next use of a page never used again.
+
+static int page_size = 4096;
+static long kernel_space_size = 4096 * 256;
+static long window = 100000;
+static int quiet = 0;
+
+// The distinct pages of the trace, numbered in order of first access, in a hash table over (pid, virtual page id).
+static int * page_pid;
+static long * page_vpn;
+static int num_pages;
+static int page_capacity;
+static int * table; // Page ids, -1 for an empty slot.
+static long table_size;
+
+// Per page state of the analyses below, grown with the pages.
+static long * last_time;   // The time of the last access (stack distances), -1 before the first one.
+static long * distances;   // Number of accesses at each stack distance (indexed by distance, not by page).
+static long * last_window; // The last window the page was accessed in (working sets).
+
+static void grow_pages(){
+	page_capacity *= 2;
+	page_pid = (int *)realloc(page_pid, sizeof(int) * page_capacity);
+	page_vpn = (long *)realloc(page_vpn, sizeof(long) * page_capacity);
+	last_time = (long *)realloc(last_time, sizeof(long) * page_capacity);
+	distances = (long *)realloc(distances, sizeof(long) * page_capacity);
+	last_window = (long *)realloc(last_window, sizeof(long) * page_capacity);
+}
+
+static unsigned long hash_page(int pid, long vpn){
+	return ((unsigned long)vpn * 0x9e3779b97f4a7c15ul) ^ ((unsigned long)pid * 0xc2b2ae3d27d4eb4ful);
+}
+
+static void table_insert(int id){
+	unsigned long i = hash_page(page_pid[id], page_vpn[id]) & (table_size - 1);
+	while(table[i] != -1)
+		i = (i + 1) & (table_size - 1);
+	table[i] = id;
+}
+
+// Return the id of a page, numbering it if it is new.
+static int page_id(int pid, long vpn){
+	unsigned long i = hash_page(pid, vpn) & (table_size - 1);
+	while(table[i] != -1){
+		if(page_pid[table[i]] == pid && page_vpn[table[i]] == vpn)
+			return table[i];
+		i = (i + 1) & (table_size - 1);
+	}
+	if(num_pages == page_capacity)
+		grow_pages();
+	int id = num_pages++;
+	page_pid[id] = pid;
+	page_vpn[id] = vpn;
+	last_time[id] = -1;
+	distances[id] = 0;
+	last_window[id] = -1;
+	if((long)num_pages * 2 > table_size){
+		table_size *= 2;
+		table = (int *)realloc(table, sizeof(int) * table_size);
+		memset(table, -1, sizeof(int) * table_size);
+		for(int j = 0; j < num_pages; j++)
+			table_insert(j);
+	}
+	else
+		table[i] = id;
+	return id;
+}
+
+/*
+        LRU stack distances with a Fenwick tree over the time of the last access of each page: the distance of an
+        access is the number of pages whose last access is between the last access of its page and now.
+        Times are renumbered from 0 (keeping their order) when they reach the size of the tree, so the tree stays
+        within twice the number of distinct pages.
+*/
+static int * fenwick;
+static long fenwick_size;
+static long now;
+static long cold_misses;
+
+static void fenwick_add(long i, int delta){
+	for(i++; i <= fenwick_size; i += i & -i)
+		fenwick[i - 1] += delta;
+}
+
+// Number of pages whose last access is at a time < i.
+static long fenwick_sum(long i){
+	long sum = 0;
+	for(; i > 0; i -= i & -i)
+		sum += fenwick[i - 1];
+	return sum;
+}
+
+static void fenwick_compact(){
+	long * order = (long *)malloc(sizeof(long) * fenwick_size);
+	memset(order, -1, sizeof(long) * fenwick_size);
+	for(int id = 0; id < num_pages; id++){
+		if(last_time[id] >= 0)
+			order[last_time[id]] = id;
+	}
+	long live = 0;
+	for(long t = 0; t < fenwick_size; t++){
+		if(order[t] != -1)
+			last_time[order[t]] = live++;
+	}
+	free(order);
+	if(live * 2 > fenwick_size)
+		fenwick_size = live * 2;
+	fenwick = (int *)realloc(fenwick, sizeof(int) * fenwick_size);
+	memset(fenwick, 0, sizeof(int) * fenwick_size);
+	for(long t = 0; t < live; t++)
+		fenwick_add(t, 1);
+	now = live;
+}
+
+static void stack_access(int id){
+	if(now == fenwick_size)
+		fenwick_compact();
+	if(last_time[id] < 0)
+		cold_misses++;
+	else {
+		distances[fenwick_sum(now) - fenwick_sum(last_time[id] + 1)]++;
+		fenwick_add(last_time[id], -1);
+	}
+	last_time[id] = now;
+	fenwick_add(now, 1);
+	now++;
+}
+
+// Working sets: the number of distinct pages of each process in the current window.
+static long * working_set; // Per process.
+static long * working_set_sum;
+static long * working_set_max;
+static int num_pids;
+
+static void working_set_end(long index){
+	if(!quiet)
+		printf("window %ld:", index);
+	for(int pid = 0; pid < num_pids; pid++){
+		if(!quiet && working_set[pid] > 0)
+			printf(" %d:%ld", pid, working_set[pid]);
+		working_set_sum[pid] += working_set[pid];
+		if(working_set[pid] > working_set_max[pid])
+			working_set_max[pid] = working_set[pid];
+		working_set[pid] = 0;
+	}
+	if(!quiet)
+		printf("\n");
+}
+
+static void working_set_access(int id, long index){
+	int pid = page_pid[id];
+	if(pid >= num_pids){
+		working_set = (long *)realloc(working_set, sizeof(long) * (pid + 1));
+		working_set_sum = (long *)realloc(working_set_sum, sizeof(long) * (pid + 1));
+		working_set_max = (long *)realloc(working_set_max, sizeof(long) * (pid + 1));
+		for(; num_pids <= pid; num_pids++){
+			working_set[num_pids] = 0;
+			working_set_sum[num_pids] = 0;
+			working_set_max[num_pids] = 0;
+		}
+	}
+	if(last_window[id] != index / window){
+		last_window[id] = index / window;
+		working_set[pid]++;
+	}
+}
+
+/*
+        OPT over the page ids of the trace (ids) and the index of the next access to the same page (next_uses):
+        the resident pages are in a max-heap by their next use, so the root is the page to evict.
+*/
+static int * heap;
+static int heap_size;
+static int * heap_pos;   // Per page, its index in heap, -1 when not resident.
+static int64_t * heap_key;
+
+static void heap_swap(int a, int b){
+	int t = heap[a];
+	heap[a] = heap[b];
+	heap[b] = t;
+	heap_pos[heap[a]] = a;
+	heap_pos[heap[b]] = b;
+}
+
+static void heap_up(int i){
+	while(i > 0 && heap_key[heap[(i - 1) / 2]] < heap_key[heap[i]]){
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_down(int i){
+	while(1){
+		int largest = i;
+		for(int c = 2 * i + 1; c <= 2 * i + 2 && c < heap_size; c++){
+			if(heap_key[heap[c]] > heap_key[heap[largest]])
+				largest = c;
+		}
+		if(largest == i)
+			return;
+		heap_swap(i, largest);
+		i = largest;
+	}
+}
+
+static long opt_misses(FILE * ids, FILE * next_uses, long num_accesses, int frames){
+	heap = (int *)malloc(sizeof(int) * frames);
+	heap_pos = (int *)malloc(sizeof(int) * num_pages);
+	heap_key = (int64_t *)malloc(sizeof(int64_t) * num_pages);
+	memset(heap_pos, -1, sizeof(int) * num_pages);
+	heap_size = 0;
+
+	uint32_t * id_block = (uint32_t *)malloc(sizeof(uint32_t) * BLOCK_ENTRIES);
+	int64_t * next_block = (int64_t *)malloc(sizeof(int64_t) * BLOCK_ENTRIES);
+	rewind(ids);
+	rewind(next_uses);
+	long misses = 0;
+	for(long start = 0; start < num_accesses; start += BLOCK_ENTRIES){
+		size_t n = num_accesses - start < BLOCK_ENTRIES ? num_accesses - start : BLOCK_ENTRIES;
+		if(fread(id_block, sizeof(uint32_t), n, ids) != n || fread(next_block, sizeof(int64_t), n, next_uses) != n){
+			printf("error reading the temporary files\n");
+			exit(-1);
+		}
+		for(size_t i = 0; i < n; i++){
+			int id = id_block[i];
+			heap_key[id] = next_block[i];
+			if(heap_pos[id] != -1){
+				// Its next use moves later.
+				heap_up(heap_pos[id]);
+				continue;
+			}
+			misses++;
+			if(heap_size == frames){
+				int victim = heap[0];
+				heap[0] = heap[--heap_size];
+				if(heap_size > 0){
+					heap_pos[heap[0]] = 0;
+					heap_down(0);
+				}
+				heap_pos[victim] = -1;
+			}
+			heap[heap_size] = id;
+			heap_pos[id] = heap_size;
+			heap_up(heap_size++);
+		}
+	}
+	free(id_block);
+	free(next_block);
+	free(heap);
+	free(heap_pos);
+	free(heap_key);
+	return misses;
+}
+
+// Write the index of the next access to the same page for each access, reading the page ids backward.
+static void compute_next_uses(FILE * ids, FILE * next_uses, long num_accesses){
+	int64_t * next_pos = (int64_t *)malloc(sizeof(int64_t) * (num_pages > 0 ? num_pages : 1));
+	for(int id = 0; id < num_pages; id++)
+		next_pos[id] = NEVER;
+	uint32_t * id_block = (uint32_t *)malloc(sizeof(uint32_t) * BLOCK_ENTRIES);
+	int64_t * next_block = (int64_t *)malloc(sizeof(int64_t) * BLOCK_ENTRIES);
+	for(long end = num_accesses; end > 0; ){
+		long start = end > BLOCK_ENTRIES ? end - BLOCK_ENTRIES : 0;
+		size_t n = end - start;
+		if(fseeko(ids, (off_t)start * sizeof(uint32_t), SEEK_SET) != 0 || fread(id_block, sizeof(uint32_t), n, ids) != n){
+			printf("error reading the temporary files\n");
+			exit(-1);
+		}
+		for(long i = end - 1; i >= start; i--){
+			next_block[i - start] = next_pos[id_block[i - start]];
+			next_pos[id_block[i - start]] = i;
+		}
+		if(fseeko(next_uses, (off_t)start * sizeof(int64_t), SEEK_SET) != 0 || fwrite(next_block, sizeof(int64_t), n, next_uses) != n){
+			printf("error writing the temporary files\n");
+			exit(-1);
+		}
+		end = start;
+	}
+	fflush(next_uses);
+	free(id_block);
+	free(next_block);
+	free(next_pos);
+}
+
+int main(int argc, char ** argv){
+	int opt;
+	while((opt = getopt(argc, argv, "p:k:W:q")) != -1){
+		switch(opt){
+		case 'p': page_size = atoi(optarg); break;
+		case 'k': kernel_space_size = atol(optarg); break;
+		case 'W': window = atol(optarg); break;
+		case 'q': quiet = 1; break;
+		default:
+			printf("usage: %s [-p page bytes] [-k kernel bytes] [-W window] [-q] FILE\n", argv[0]);
+			exit(-1);
+		}
+	}
+	int frames = (int)(kernel_space_size / (page_size > 0 ? page_size : 1));
+	if(optind != argc - 1 || page_size <= 0 || frames <= 0 || window <= 0){
+		printf("usage: %s [-p page bytes] [-k kernel bytes] [-W window] [-q] FILE\n", argv[0]);
+		exit(-1);
+	}
+	FILE * trace = fopen(argv[optind], "r");
+	FILE * ids = tmpfile();
+	FILE * next_uses = tmpfile();
+	if(trace == NULL || ids == NULL || next_uses == NULL){
+		printf("error opening %s or the temporary files\n", argv[optind]);
+		exit(-1);
+	}
+
+	page_capacity = 512;
+	grow_pages();
+	table_size = 2048;
+	table = (int *)malloc(sizeof(int) * table_size);
+	memset(table, -1, sizeof(int) * table_size);
+	fenwick_size = 1 << 16;
+	fenwick = (int *)calloc(fenwick_size, sizeof(int));
+
+	// The first pass: number the pages, and compute the stack distances and the working sets.
+	// An access spanning several pages accesses each of them in turn.
+	uint32_t * id_block = (uint32_t *)malloc(sizeof(uint32_t) * BLOCK_ENTRIES);
+	size_t block_used = 0;
+	long num_accesses = 0;
+	char op;
+	int pid;
+	long addr;
+	int size;
+	while(fscanf(trace, " %c %d %ld %d", &op, &pid, &addr, &size) == 4){
+		if((op != 'r' && op != 'w') || pid < 0 || addr < 0 || size <= 0){
+			printf("invalid access in the trace: %c %d %ld %d\n", op, pid, addr, size);
+			exit(-1);
+		}
+		for(long vpn = addr / page_size; vpn <= (addr + size - 1) / page_size; vpn++){
+			if(num_accesses > 0 && num_accesses % window == 0)
+				working_set_end(num_accesses / window - 1);
+			int id = page_id(pid, vpn);
+			stack_access(id);
+			working_set_access(id, num_accesses);
+			id_block[block_used++] = id;
+			if(block_used == BLOCK_ENTRIES){
+				fwrite(id_block, sizeof(uint32_t), block_used, ids);
+				block_used = 0;
+			}
+			num_accesses++;
+		}
+	}
+	if(num_accesses > 0)
+		working_set_end((num_accesses - 1) / window);
+	if(block_used > 0)
+		fwrite(id_block, sizeof(uint32_t), block_used, ids);
+	free(id_block);
+	if(fflush(ids) != 0){
+		printf("error writing the temporary files\n");
+		exit(-1);
+	}
+	long num_windows = (num_accesses + window - 1) / window;
+
+	printf("%ld page accesses, %d distinct pages, %d pages of kernel-managed memory\n", num_accesses, num_pages, frames);
+	for(int p = 0; p < num_pids; p++){
+		if(working_set_max[p] > 0)
+			printf("process %d: working set mean %.1f pages, max %ld pages (windows of %ld accesses)\n",
+			       p, num_windows > 0 ? (double)working_set_sum[p] / num_windows : 0.0, working_set_max[p], window);
+	}
+
+	// LRU misses with c pages: the cold misses and the accesses at a stack distance >= c.
+	long * misses = (long *)malloc(sizeof(long) * (num_pages + 1));
+	misses[num_pages] = cold_misses;
+	for(int c = num_pages - 1; c >= 0; c--)
+		misses[c] = misses[c + 1] + distances[c];
+	printf("LRU miss ratio curve:\n");
+	for(long c = 1; c <= num_pages; c = c * 2 > c + 1 ? c * 2 : c + 1){
+		printf("  %8ld pages: %ld misses (%.4f)\n", c, misses[c], num_accesses > 0 ? (double)misses[c] / num_accesses : 0.0);
+		if(c < frames && c * 2 > frames && frames <= num_pages)
+			printf("  %8d pages: %ld misses (%.4f)\n", frames, misses[frames], (double)misses[frames] / num_accesses);
+	}
+
+	compute_next_uses(ids, next_uses, num_accesses);
+	long lru = misses[frames < num_pages ? frames : num_pages];
+	long best = opt_misses(ids, next_uses, num_accesses, frames);
+	printf("with %d pages: LRU %ld misses, OPT %ld misses (LRU %.2fx OPT)\n", frames, lru, best, best > 0 ? (double)lru / best : 1.0);
+
+	free(misses);
+	fclose(trace);
+	fclose(ids);
+	fclose(next_uses);
+	free(page_pid);
+	free(page_vpn);
+	free(table);
+	free(last_time);
+	free(fenwick);
+	free(distances);
+	free(last_window);
+	free(working_set);
+	free(working_set_sum);
+	free(working_set_max);
+	return 0;
+}
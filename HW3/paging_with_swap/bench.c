@@ -0,0 +1,331 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kernel.h"
+
+/*
+        Replay a memory access trace against the paging kernel, and report the throughput, the fault rate,
+        the swap-ins and swap-outs, and the latency of an access.
+
+        ./Bench [options] seq|random|zipf|loop|mix|FILE
+                seq     one process reading and writing its pages in order.
+                random  one process accessing its pages uniformly at random.
+                zipf    one process accessing its pages with a Zipfian popularity (-z).
+                loop    one process sweeping in order over a range 1.5 times larger than kernel-managed memory.
+                mix     -c processes, running seq, random, zipf and loop in turn, with their accesses interleaved.
+                FILE    a recorded trace, one access per line: "r|w pid addr size", where pid is the index of
+                        a process of the trace, below -c (a process of -v bytes is created on its first access).
+        Options:
+                -n accesses (1000000)        -k KERNEL_SPACE_SIZE (1 MiB)  -v process size (4 MiB)
+                -p PAGE_SIZE (4096)          -s bytes per access (8)       -w percent of writes (30)
+                -c processes (4)             -z Zipf exponent (0.99)       -r random seed (1)
+                -P PAGE_REPLACEMENT_POLICY   -C SWAP_CLUSTER_SIZE          -R SWAP_READAHEAD_PAGES
+                -Z ZSWAP_POOL_SIZE           -o FILE (also save the trace replayed, for analyze.c)
+                -H (processes with huge pages, VM_HUGE_PAGES)
+                -q pages (the quota of each process, proc_set_quota)
+*/
+
+enum {
+	PATTERN_SEQ,
+	PATTERN_RANDOM,
+	PATTERN_ZIPF,
+	PATTERN_LOOP,
+	PATTERN_MIX,
+	PATTERN_FILE,
+};
+
+static const char * pattern_names[] = { "seq", "random", "zipf", "loop", "mix" };
+static const char * policy_names[] = { "LRU", "CLOCK", "2Q", "ARC" };
+
+struct Access {
+	int pid; // Index of the process in the trace.
+	int write;
+	long addr;
+	int size;
+};
+
+// The synthetic access stream of a process.
+struct Stream {
+	int pattern;
+	long cursor; // Next address of seq and loop.
+};
+
+static long num_accesses = 1000000;
+static long process_size = 4096 * 1024;
+static int access_size = 8;
+static int write_percent = 30;
+static int num_processes = 4;
+static double zipf_exponent = 0.99;
+static unsigned long long seed = 1;
+static int vm_flags = 0; // Flags of proc_create_vm_flags.
+static long quota = 0;   // Quota of each process, in pages.
+
+static struct Stream * streams;
+static double * zipf_cdf; // Cumulative probability of the pages of a process by rank, for PATTERN_ZIPF.
+static long num_pages;
+
+// xorshift64*, so that traces do not depend on the C library.
+static unsigned long long next_random(){
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ull;
+}
+
+static double next_uniform(){
+	return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(){
+	zipf_cdf = (double *)malloc(sizeof(double) * num_pages);
+	double sum = 0;
+	for(long i = 0; i < num_pages; i++){
+		sum += 1.0 / pow(i + 1, zipf_exponent);
+		zipf_cdf[i] = sum;
+	}
+	for(long i = 0; i < num_pages; i++)
+		zipf_cdf[i] /= sum;
+}
+
+static long zipf_page(){
+	double u = next_uniform();
+	long lo = 0;
+	long hi = num_pages - 1;
+	while(lo < hi){
+		long mid = (lo + hi) / 2;
+		if(zipf_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// The next access of the synthetic stream of process pid.
+static void next_synthetic(int pid, struct Access * access){
+	struct Stream * stream = &streams[pid];
+	long span = process_size - access_size;
+	access->pid = pid;
+	access->write = (int)(next_random() % 100) < write_percent;
+	access->size = access_size;
+	switch(stream->pattern){
+	case PATTERN_SEQ:
+	case PATTERN_LOOP:
+		access->addr = stream->cursor;
+		stream->cursor += access_size;
+		// loop sweeps a range 1.5 times larger than kernel-managed memory, or the whole process if smaller.
+		if(stream->cursor > span || (stream->pattern == PATTERN_LOOP && stream->cursor >= (long)KERNEL_SPACE_SIZE * 3 / 2))
+			stream->cursor = 0;
+		break;
+	case PATTERN_RANDOM:
+		access->addr = (long)(next_random() % (span / access_size + 1)) * access_size;
+		break;
+	default:
+		access->addr = zipf_page() * PAGE_SIZE + (long)(next_random() % (PAGE_SIZE / access_size)) * access_size;
+		if(access->addr > span)
+			access->addr = span;
+		break;
+	}
+}
+
+// Read the next access of a trace file, return 0 at its end.
+static int next_recorded(FILE * trace, struct Access * access){
+	char op;
+	while(fscanf(trace, " %c %d %ld %d", &op, &access->pid, &access->addr, &access->size) == 4){
+		if(op != 'r' && op != 'w')
+			continue;
+		access->write = op == 'w';
+		if(access->pid < 0 || access->pid >= num_processes || access->addr < 0 || access->size <= 0 || access->addr + access->size > process_size){
+			printf("access out of range in the trace: %c %d %ld %d\n", op, access->pid, access->addr, access->size);
+			exit(-1);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+// Latencies are counted in a log-linear histogram: exact below HIST_SUB ns, then HIST_SUB buckets per power of 2.
+#define HIST_SUB 16
+static long histogram[64 * HIST_SUB];
+
+static int hist_bucket(long ns){
+	if(ns < HIST_SUB)
+		return ns;
+	int e = 63 - __builtin_clzl(ns);
+	return (e - 3) * HIST_SUB + ((ns >> (e - 4)) & (HIST_SUB - 1));
+}
+
+static long hist_value(int bucket){
+	if(bucket < HIST_SUB)
+		return bucket;
+	int e = bucket / HIST_SUB + 3;
+	return (long)(HIST_SUB + bucket % HIST_SUB) << (e - 4);
+}
+
+static long hist_percentile(long count, double percent){
+	long rank = (long)ceil(count * percent / 100);
+	long seen = 0;
+	for(int i = 0; i < 64 * HIST_SUB; i++){
+		seen += histogram[i];
+		if(seen >= rank && histogram[i] > 0)
+			return hist_value(i);
+	}
+	return 0;
+}
+
+static int create_process(struct Kernel * kernel){
+	int pid = proc_create_vm_flags(kernel, process_size, vm_flags);
+	if(quota > 0)
+		proc_set_quota(kernel, pid, quota);
+	return pid;
+}
+
+static long now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int main(int argc, char ** argv){
+	KERNEL_SPACE_SIZE = 4096 * 256;
+	PAGE_SIZE = 4096;
+	const char * save_path = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "n:k:v:p:s:w:c:z:r:P:C:R:Z:o:Hq:")) != -1){
+		switch(opt){
+		case 'n': num_accesses = atol(optarg); break;
+		case 'k': KERNEL_SPACE_SIZE = atoi(optarg); break;
+		case 'v': process_size = atol(optarg); break;
+		case 'p': PAGE_SIZE = atoi(optarg); break;
+		case 's': access_size = atoi(optarg); break;
+		case 'w': write_percent = atoi(optarg); break;
+		case 'c': num_processes = atoi(optarg); break;
+		case 'z': zipf_exponent = atof(optarg); break;
+		case 'r': seed = strtoull(optarg, NULL, 10); break;
+		case 'P': PAGE_REPLACEMENT_POLICY = atoi(optarg); break;
+		case 'C': SWAP_CLUSTER_SIZE = atoi(optarg); break;
+		case 'R': SWAP_READAHEAD_PAGES = atoi(optarg); break;
+		case 'Z': ZSWAP_POOL_SIZE = atol(optarg); break;
+		case 'o': save_path = optarg; break;
+		case 'H': vm_flags |= VM_HUGE_PAGES; break;
+		case 'q': quota = atol(optarg); break;
+		default:
+			printf("usage: %s [-n accesses] [-k kernel bytes] [-v process bytes] [-p page bytes] [-s access bytes] [-w write %%]\n"
+			       "       [-c processes] [-z zipf exponent] [-r seed] [-P policy] [-C cluster] [-R readahead] [-Z zswap bytes]\n"
+			       "       [-o save trace] [-H] [-q quota pages] seq|random|zipf|loop|mix|FILE\n", argv[0]);
+			exit(-1);
+		}
+	}
+	if(optind != argc - 1){
+		printf("missing the access pattern or trace file\n");
+		exit(-1);
+	}
+	int pattern = PATTERN_FILE;
+	for(int i = 0; i < PATTERN_FILE; i++){
+		if(strcmp(argv[optind], pattern_names[i]) == 0)
+			pattern = i;
+	}
+	if(pattern != PATTERN_MIX && pattern != PATTERN_FILE)
+		num_processes = 1;
+	if(seed == 0 || num_processes <= 0 || access_size <= 0 || access_size > PAGE_SIZE || PAGE_SIZE % access_size != 0 || process_size < PAGE_SIZE || quota < 0){
+		printf("invalid options\n");
+		exit(-1);
+	}
+
+	FILE * trace = NULL;
+	if(pattern == PATTERN_FILE && (trace = fopen(argv[optind], "r")) == NULL){
+		printf("error opening trace %s\n", argv[optind]);
+		exit(-1);
+	}
+	FILE * save = NULL;
+	if(save_path != NULL && (save = fopen(save_path, "w")) == NULL){
+		printf("error creating trace %s\n", save_path);
+		exit(-1);
+	}
+
+	VIRTUAL_SPACE_SIZE = process_size;
+	MAX_PROCESS_NUM = num_processes;
+	num_pages = process_size / PAGE_SIZE;
+	streams = (struct Stream *)calloc(num_processes, sizeof(struct Stream));
+	for(int i = 0; i < num_processes; i++)
+		streams[i].pattern = pattern == PATTERN_MIX ? i % PATTERN_MIX : pattern;
+	if(pattern == PATTERN_ZIPF || (pattern == PATTERN_MIX && num_processes > PATTERN_ZIPF))
+		zipf_init();
+
+	struct Kernel * kernel = init_kernel();
+	int * pids = (int *)malloc(sizeof(int) * num_processes);
+	for(int i = 0; i < num_processes; i++)
+		pids[i] = pattern == PATTERN_FILE ? -1 : create_process(kernel);
+	// Writes store non-zero bytes, so the pages written are not elided as zero pages on eviction.
+	int buf_size = PAGE_SIZE;
+	char * data = (char *)malloc(buf_size);
+	char * buf = (char *)malloc(buf_size);
+	memset(data, 0x5a, buf_size);
+
+	long count = 0;
+	long start = now_ns();
+	struct Access access;
+	while(pattern == PATTERN_FILE ? next_recorded(trace, &access) : count < num_accesses){
+		if(pattern != PATTERN_FILE)
+			next_synthetic(num_processes == 1 ? 0 : (int)(next_random() % num_processes), &access);
+		if(pids[access.pid] == -1)
+			pids[access.pid] = create_process(kernel);
+		if(save != NULL)
+			fprintf(save, "%c %d %ld %d\n", access.write ? 'w' : 'r', access.pid, access.addr, access.size);
+
+		// An access of a recorded trace may be larger than a page.
+		if(access.size > buf_size){
+			data = (char *)realloc(data, access.size);
+			buf = (char *)realloc(buf, access.size);
+			memset(data + buf_size, 0x5a, access.size - buf_size);
+			buf_size = access.size;
+		}
+		long begin = now_ns();
+		int ret = access.write ? vm_write(kernel, pids[access.pid], (char *)access.addr, access.size, data)
+		                       : vm_read(kernel, pids[access.pid], (char *)access.addr, access.size, buf);
+		histogram[hist_bucket(now_ns() - begin)]++;
+		if(ret != 0){
+			printf("access failed: %c %d %ld %d\n", access.write ? 'w' : 'r', access.pid, access.addr, access.size);
+			exit(-1);
+		}
+		count++;
+	}
+	double seconds = (now_ns() - start) / 1e9;
+
+	printf("pattern %s, %ld accesses (%d%% writes), %d processes of %ld pages%s, %d pages of kernel-managed memory, policy %s\n",
+	       pattern == PATTERN_FILE ? argv[optind] : pattern_names[pattern], count, write_percent, num_processes, num_pages,
+	       (vm_flags & VM_HUGE_PAGES) ? " (huge pages)" : "", KERNEL_SPACE_SIZE / PAGE_SIZE, PAGE_REPLACEMENT_POLICY >= 0 && PAGE_REPLACEMENT_POLICY < 4 ? policy_names[PAGE_REPLACEMENT_POLICY] : "?");
+	printf("time %.3f s, %.0f accesses/s\n", seconds, count / (seconds > 0 ? seconds : 1e-9));
+	struct PagingStats stats;
+	get_kernel_stats(kernel, &stats);
+	long faults = stats.minor_faults + stats.major_faults;
+	printf("faults %ld (%.2f%%, %ld major), swap-ins %ld, swap-outs %ld (%ld evictions)\n", faults,
+	       count > 0 ? 100.0 * faults / count : 0.0, stats.major_faults, stats.swap_ins, stats.write_backs, stats.evictions);
+	printf("latency p50 %ld ns, p99 %ld ns, max %ld ns\n", hist_percentile(count, 50), hist_percentile(count, 99), hist_percentile(count, 100));
+	// With a quota, each process evicts its own pages, so show how they share the faults.
+	for(int i = 0; quota > 0 && i < num_processes; i++){
+		if(pids[i] != -1 && get_proc_stats(kernel, pids[i], &stats) == 0)
+			printf("process %d (quota %ld pages): resident %ld, faults %ld, evictions %ld\n", i, quota, stats.resident_pages,
+			       stats.minor_faults + stats.major_faults, stats.evictions);
+	}
+
+	for(int i = 0; i < num_processes; i++){
+		if(pids[i] != -1)
+			proc_exit_vm(kernel, pids[i]);
+	}
+	destroy_kernel(kernel);
+	if(trace != NULL)
+		fclose(trace);
+	if(save != NULL)
+		fclose(save);
+	free(data);
+	free(buf);
+	free(pids);
+	free(streams);
+	free(zipf_cdf);
+	return 0;
+}
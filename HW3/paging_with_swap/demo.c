@@ -13,7 +13,7 @@ int main() {
 	MAX_PROCESS_NUM = 8;
 
 	printf("---------------- Demo Program ----------------\n");
-	printf("KERNEL_SPACE_SIZE=%d\nVIRTUAL_SPACE_SIZE=%d\nPAGE_SIZE=%d\nMAX_PROCESS_NUM=%d\n", KERNEL_SPACE_SIZE, VIRTUAL_SPACE_SIZE, PAGE_SIZE, MAX_PROCESS_NUM);
+	printf("KERNEL_SPACE_SIZE=%d\nVIRTUAL_SPACE_SIZE=%ld\nPAGE_SIZE=%d\nMAX_PROCESS_NUM=%d\n", KERNEL_SPACE_SIZE, VIRTUAL_SPACE_SIZE, PAGE_SIZE, MAX_PROCESS_NUM);
 	printf("----------------------------------------------\n\n");
 
 	int score = 0;
@@ -1,92 +1,916 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "kernel.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define min(a,b) \
    ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
      _a < _b ? _a : _b; })
 
+#define max(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _a : _b; })
+
 int KERNEL_SPACE_SIZE = 256;
-int VIRTUAL_SPACE_SIZE = 512;
+long VIRTUAL_SPACE_SIZE = 512;
 int PAGE_SIZE = 32;
 int MAX_PROCESS_NUM = 8;
+int MAX_SHARED_REGIONS = 4;
+long SWAP_SPACE_SIZE = 0;
+int PAGE_REPLACEMENT_POLICY = POLICY_LRU;
+const char * SWAP_FILE_PATH = "swap";
+int SWAP_BACKEND = SWAP_BACKEND_FILE;
+int SWAP_MSYNC_ON_DESTROY = 0;
+int SWAP_FILE_REUSE = 0;
+int SWAP_FILE_PREALLOCATE = 0;
+int SWAP_CLUSTER_SIZE = 1;
+int SWAP_READAHEAD_PAGES = 0;
+long ZSWAP_POOL_SIZE = 0;
+int RECLAIM_LOW_WATERMARK = 0;
+int RECLAIM_HIGH_WATERMARK = 0;
+
+static int reclaim(struct Kernel * kernel, int num_pages, int hint, int pid, int local);
+static void apply_hits(struct Kernel * kernel, int pid);
+static void * kswapd(void * arg);
+
+// Allocate a bitmap of size bits, all free.
+static void bitmap_init(struct Bitmap * bitmap, int size){
+	int num_words = (size + 63) / 64;
+	int num_summary_words = (num_words + 63) / 64;
+	bitmap->size = size;
+	bitmap->words = (uint64_t *)calloc(num_words, sizeof(uint64_t));
+	bitmap->summary = (uint64_t *)calloc(num_summary_words, sizeof(uint64_t));
+	if(size % 64 != 0)
+		bitmap->words[num_words - 1] = ~0ULL << (size % 64);
+	if(num_words % 64 != 0)
+		bitmap->summary[num_summary_words - 1] = ~0ULL << (num_words % 64);
+}
+
+static void bitmap_free(struct Bitmap * bitmap){
+	free(bitmap->words);
+	free(bitmap->summary);
+}
+
+static inline int bitmap_test(struct Bitmap * bitmap, int i){
+	return (bitmap->words[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bitmap_set(struct Bitmap * bitmap, int i){
+	bitmap->words[i / 64] |= 1ULL << (i % 64);
+	if(bitmap->words[i / 64] == ~0ULL)
+		bitmap->summary[i / 4096] |= 1ULL << (i / 64 % 64);
+}
+
+static inline void bitmap_clear(struct Bitmap * bitmap, int i){
+	bitmap->words[i / 64] &= ~(1ULL << (i % 64));
+	bitmap->summary[i / 4096] &= ~(1ULL << (i / 64 % 64));
+}
+
+// Return the first free bit, -1 if the bitmap is full.
+static int bitmap_find_first_zero(struct Bitmap * bitmap){
+	int num_summary_words = ((bitmap->size + 63) / 64 + 63) / 64;
+	for(int s = 0; s < num_summary_words; s++){
+		if(bitmap->summary[s] != ~0ULL){
+			int w = s * 64 + __builtin_ctzll(~bitmap->summary[s]);
+			return w * 64 + __builtin_ctzll(~bitmap->words[w]);
+		}
+	}
+	return -1;
+}
+
+// Return the first bit of a run of n free bits, -1 if there is none. Full words are skipped through the summary.
+static int bitmap_find_zero_run(struct Bitmap * bitmap, int n){
+	int start = 0;
+	int length = 0;
+	for(int w = 0; w < (bitmap->size + 63) / 64; w++){
+		if((bitmap->summary[w / 64] >> (w % 64)) & 1){
+			length = 0;
+			continue;
+		}
+		uint64_t word = bitmap->words[w];
+		for(int b = 0; b < 64; b++){
+			if((word >> b) & 1){
+				length = 0;
+				continue;
+			}
+			if(length == 0)
+				start = w * 64 + b;
+			if(++length == n)
+				return start;
+		}
+	}
+	return -1;
+}
+
+// Put the free block of the given order starting at page pfn on its free list.
+static void buddy_push(struct BuddyAllocator * buddy, int pfn, int order){
+	buddy->order[pfn] = order;
+	buddy->prev[pfn] = -1;
+	buddy->next[pfn] = buddy->free_lists[order];
+	if(buddy->free_lists[order] != -1)
+		buddy->prev[buddy->free_lists[order]] = pfn;
+	buddy->free_lists[order] = pfn;
+}
+
+// Take the free block starting at page pfn off its free list.
+static void buddy_remove(struct BuddyAllocator * buddy, int pfn){
+	if(buddy->prev[pfn] != -1)
+		buddy->next[buddy->prev[pfn]] = buddy->next[pfn];
+	else
+		buddy->free_lists[buddy->order[pfn]] = buddy->next[pfn];
+	if(buddy->next[pfn] != -1)
+		buddy->prev[buddy->next[pfn]] = buddy->prev[pfn];
+	buddy->order[pfn] = -1;
+}
+
+// Set up a buddy allocator over num_pages free pages: the largest aligned blocks that fit, in address order.
+static void buddy_init(struct BuddyAllocator * buddy, int num_pages){
+	buddy->next = (int *)malloc(sizeof(int) * num_pages);
+	buddy->prev = (int *)malloc(sizeof(int) * num_pages);
+	buddy->order = (signed char *)malloc(sizeof(signed char) * num_pages);
+	memset(buddy->order, -1, num_pages);
+	for(int k = 0; k <= BUDDY_MAX_ORDER; k++)
+		buddy->free_lists[k] = -1;
+	for(int pfn = 0; pfn < num_pages; ){
+		int k = BUDDY_MAX_ORDER;
+		while(pfn % (1 << k) != 0 || pfn + (1 << k) > num_pages)
+			k--;
+		buddy_push(buddy, pfn, k);
+		pfn += 1 << k;
+	}
+}
+
+static void buddy_free_lists(struct BuddyAllocator * buddy){
+	free(buddy->next);
+	free(buddy->prev);
+	free(buddy->order);
+}
+
+// Take a block of 2^order free pages of kernel-managed memory and return its first page, -1 if there is none.
+// A larger block is split in halves, the first half kept and the second freed, until it has the order.
+// The caller holds frame_lock.
+static int buddy_alloc(struct Kernel * kernel, int order){
+	struct BuddyAllocator * buddy = &kernel->buddy;
+	int k = order;
+	while(k <= BUDDY_MAX_ORDER && buddy->free_lists[k] == -1)
+		k++;
+	if(k > BUDDY_MAX_ORDER)
+		return -1;
+	int pfn = buddy->free_lists[k];
+	buddy_remove(buddy, pfn);
+	while(k > order){
+		k--;
+		buddy_push(buddy, pfn + (1 << k), k);
+	}
+	for(int i = 0; i < 1 << order; i++)
+		bitmap_set(&kernel->occupied_pages, pfn + i);
+	kernel->free_pages -= 1 << order;
+	return pfn;
+}
+
+// Free the block of 2^order pages of kernel-managed memory at pfn (aligned to its size), and merge it with its buddy
+// while the buddy is a free block of the same order. A block is freed whatever blocks its pages were taken in,
+// as long as they are all taken. The caller holds frame_lock.
+static void buddy_free(struct Kernel * kernel, int pfn, int order){
+	struct BuddyAllocator * buddy = &kernel->buddy;
+	for(int i = 0; i < 1 << order; i++)
+		bitmap_clear(&kernel->occupied_pages, pfn + i);
+	kernel->free_pages += 1 << order;
+	int k = order;
+	while(k < BUDDY_MAX_ORDER){
+		int buddy_pfn = pfn ^ (1 << k);
+		if(buddy_pfn >= kernel->occupied_pages.size || buddy->order[buddy_pfn] != k)
+			break;
+		buddy_remove(buddy, buddy_pfn);
+		pfn &= ~(1 << k);
+		k++;
+	}
+	buddy_push(buddy, pfn, k);
+}
+
+// Number of virtual pages of a process.
+static long num_virtual_pages(struct MMStruct * mm){
+	return (mm->size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+// A last-level slot of a page table holding the PTE of a huge page instead of a table, see struct MMStruct.
+static inline int table_is_huge(void * table){
+	return ((uintptr_t)table & 1) != 0;
+}
+
+static inline struct PTE * huge_pte(void * table){
+	return (struct PTE *)((uintptr_t)table & ~(uintptr_t)1);
+}
+
+// Whether the block of HUGE_PAGE_PAGES pages of a virtual page is mapped by a huge page on its first access:
+// the process asked for huge pages, and the whole block is within it.
+static int huge_block(struct MMStruct * mm, long virtual_page_id){
+	return mm->huge && (virtual_page_id | (HUGE_PAGE_PAGES - 1)) < num_virtual_pages(mm);
+}
+
+// Walk the page table of a process to the slot of the last-level table of a virtual page. The tables missing on
+// the way are allocated when alloc is 1, otherwise NULL is returned when one is missing.
+static void ** table_slot(struct MMStruct * mm, long virtual_page_id, int alloc){
+	void ** slot = &mm->page_table;
+	for(int level = mm->levels - 1; level > 0; level--){
+		if(*slot == NULL){
+			if(!alloc)
+				return NULL;
+			*slot = calloc(PAGE_TABLE_ENTRIES, sizeof(void *));
+		}
+		slot = &((void **)*slot)[(virtual_page_id >> (level * PAGE_TABLE_BITS)) & (PAGE_TABLE_ENTRIES - 1)];
+	}
+	return slot;
+}
+
+// Walk the page table of a process to the PTE of a virtual page, the PTE of the huge page in a block mapped by one.
+// The tables missing on the way are allocated when alloc is 1 (a new PTE is not present and has PFN -1, and is the
+// PTE of a huge page for a block of huge_block), otherwise NULL is returned when one is missing.
+static struct PTE * pte_walk(struct MMStruct * mm, long virtual_page_id, int alloc){
+	void ** slot = table_slot(mm, virtual_page_id, alloc);
+	if(slot == NULL || (*slot == NULL && !alloc))
+		return NULL;
+	if(*slot == NULL){
+		if(huge_block(mm, virtual_page_id)){
+			struct PTE * pte = (struct PTE *)malloc(sizeof(struct PTE));
+			pte_set(pte, -1, PTE_HUGE);
+			*slot = (void *)((uintptr_t)pte | 1);
+		}
+		else {
+			struct PTE * table = (struct PTE *)malloc(sizeof(struct PTE) * PAGE_TABLE_ENTRIES);
+			for(int i = 0; i < PAGE_TABLE_ENTRIES; i++)
+				pte_set(&table[i], -1, 0);
+			*slot = table;
+		}
+	}
+	if(table_is_huge(*slot))
+		return huge_pte(*slot);
+	return &((struct PTE *)*slot)[virtual_page_id & (PAGE_TABLE_ENTRIES - 1)];
+}
+
+// The PTE of the page held by an LRUEntry of kernel-managed memory, whose tables are allocated.
+static struct PTE * entry_pte(struct Kernel * kernel, struct LRUEntry * entry){
+	return pte_walk(&kernel->mm[entry->pid], entry->virtual_page_id, 0);
+}
+
+// Number of pages of kernel-managed memory held by the page of an LRUEntry: HUGE_PAGE_PAGES for a huge page, 1 otherwise.
+// The caller holds the lock of its process.
+static int entry_pages(struct Kernel * kernel, struct LRUEntry * entry){
+	return (pte_bits(entry_pte(kernel, entry)) & PTE_HUGE) ? HUGE_PAGE_PAGES : 1;
+}
+
+// The address in kernel-managed memory of a virtual page mapped by a present PTE.
+static char * page_address(struct Kernel * kernel, struct PTE * pte, long virtual_page_id){
+	long pfn = pte_pfn(pte);
+	if(pte_bits(pte) & PTE_HUGE)
+		pfn += virtual_page_id & (HUGE_PAGE_PAGES - 1);
+	return kernel->space + PAGE_SIZE * pfn;
+}
+
+// Clear the referenced bit of every PTE mapping the page of an LRUEntry, and return whether one of them was set.
+static int page_referenced(struct Kernel * kernel, struct LRUEntry * entry){
+	int referenced = pte_clear_flags(entry_pte(kernel, entry), PTE_REFERENCED);
+	for(struct RMap * rmap = entry->rmap; rmap != NULL; rmap = rmap->next)
+		referenced |= pte_clear_flags(pte_walk(&kernel->mm[rmap->pid], rmap->virtual_page_id, 0), PTE_REFERENCED);
+	return referenced;
+}
+
+// Unlink an entry from the local list of a process.
+static void local_unlink(struct LRU * local, struct LRUEntry * entry){
+	if(entry->local_prev == NULL)
+		local->head = entry->local_next;
+	else
+		entry->local_prev->local_next = entry->local_next;
+	if(entry->local_next == NULL)
+		local->tail = entry->local_prev;
+	else
+		entry->local_next->local_prev = entry->local_prev;
+	entry->local_next = NULL;
+	entry->local_prev = NULL;
+	local->num_entries -= 1;
+}
+
+// Append an entry to the tail of the local list of a process.
+static void local_append(struct LRU * local, struct LRUEntry * entry){
+	entry->local_next = NULL;
+	entry->local_prev = local->tail;
+	if(local->tail != NULL)
+		local->tail->local_next = entry;
+	else
+		local->head = entry;
+	local->tail = entry;
+	local->num_entries += 1;
+}
+
+// Charge the page of an LRUEntry (num_pages pages of kernel-managed memory) to the process it names, or uncharge it.
+// The caller holds lru_lock.
+static void charge_add(struct Kernel * kernel, struct LRUEntry * entry, int num_pages){
+	struct MMStruct * mm = &kernel->mm[entry->pid];
+	mm->charged += num_pages;
+	local_append(&mm->local, entry);
+}
+
+static void charge_del(struct Kernel * kernel, struct LRUEntry * entry, int num_pages){
+	struct MMStruct * mm = &kernel->mm[entry->pid];
+	mm->charged -= num_pages;
+	local_unlink(&mm->local, entry);
+}
+
+// Add (pid, virtual_page_id) to the PTEs mapping page pfn of kernel-managed memory. The caller holds lru_lock.
+static void rmap_add(struct Kernel * kernel, int pfn, int pid, long virtual_page_id){
+	struct RMap * rmap = (struct RMap *)malloc(sizeof(struct RMap));
+	rmap->pid = pid;
+	rmap->virtual_page_id = virtual_page_id;
+	rmap->next = kernel->lru_entries[pfn].rmap;
+	kernel->lru_entries[pfn].rmap = rmap;
+	kernel->page_mapcount[pfn]++;
+}
+
+// Remove (pid, virtual_page_id) from the PTEs mapping page pfn and return how many are left. The caller holds lru_lock.
+// If it is the one in the LRUEntry, the first of the rmap takes its place, and the page is charged to its process.
+static int rmap_del(struct Kernel * kernel, int pfn, int pid, long virtual_page_id){
+	struct LRUEntry * entry = &kernel->lru_entries[pfn];
+	struct RMap ** link = &entry->rmap;
+	if(entry->pid == pid && entry->virtual_page_id == virtual_page_id){
+		if(entry->rmap != NULL){
+			// A shared page is never a huge page.
+			charge_del(kernel, entry, 1);
+			entry->pid = entry->rmap->pid;
+			entry->virtual_page_id = entry->rmap->virtual_page_id;
+			charge_add(kernel, entry, 1);
+		}
+		else
+			link = NULL;
+	}
+	else {
+		while((*link)->pid != pid || (*link)->virtual_page_id != virtual_page_id)
+			link = &(*link)->next;
+	}
+	if(link != NULL){
+		struct RMap * rmap = *link;
+		*link = rmap->next;
+		free(rmap);
+	}
+	return --kernel->page_mapcount[pfn];
+}
+
+static void pte_for_each_table(void * table, int level, long base, long start, long end,
+		void (*fn)(long virtual_page_id, struct PTE * pte, void * arg), void * arg){
+	if(table == NULL)
+		return;
+	// A huge page is visited once, with the first page of its block.
+	if(level == 0 && table_is_huge(table)){
+		fn(base, huge_pte(table), arg);
+		return;
+	}
+	long span = 1L << (level * PAGE_TABLE_BITS);
+	for(long i = 0; i < PAGE_TABLE_ENTRIES; i++){
+		long virtual_page_id = base + i * span;
+		if(virtual_page_id >= end)
+			break;
+		if(virtual_page_id + span <= start)
+			continue;
+		if(level == 0)
+			fn(virtual_page_id, &((struct PTE *)table)[i], arg);
+		else
+			pte_for_each_table(((void **)table)[i], level - 1, virtual_page_id, start, end, fn, arg);
+	}
+}
+
+// Call fn on the PTE of each virtual page in [start, end) of a process whose tables are allocated, in virtual page order.
+// A huge page overlapping the range is visited once. fn may split it (split_huge_page).
+static void pte_for_each_range(struct MMStruct * mm, long start, long end, void (*fn)(long virtual_page_id, struct PTE * pte, void * arg), void * arg){
+	pte_for_each_table(mm->page_table, mm->levels - 1, 0, start, min(end, num_virtual_pages(mm)), fn, arg);
+}
+
+// Call fn on the PTE of each virtual page of a process whose tables are allocated, in virtual page order.
+static void pte_for_each(struct MMStruct * mm, void (*fn)(long virtual_page_id, struct PTE * pte, void * arg), void * arg){
+	pte_for_each_range(mm, 0, num_virtual_pages(mm), fn, arg);
+}
+
+// Find the PTE of a present virtual page in the TLB of a process, NULL if it is not cached.
+static struct PTE * tlb_lookup(struct MMStruct * mm, long virtual_page_id){
+	struct TLBEntry * set = mm->tlb[virtual_page_id & (TLB_SETS - 1)];
+	for(int i = 0; i < TLB_WAYS; i++){
+		if(set[i].virtual_page_id == virtual_page_id){
+			mm->tlb_hits++;
+			return set[i].pte;
+		}
+	}
+	mm->tlb_misses++;
+	return NULL;
+}
+
+static void tlb_insert(struct MMStruct * mm, long virtual_page_id, struct PTE * pte){
+	int index = virtual_page_id & (TLB_SETS - 1);
+	struct TLBEntry * entry = &mm->tlb[index][mm->tlb_next[index]];
+	entry->virtual_page_id = virtual_page_id;
+	entry->pte = pte;
+	mm->tlb_next[index] = (mm->tlb_next[index] + 1) % TLB_WAYS;
+}
+
+static void tlb_invalidate(struct MMStruct * mm, long virtual_page_id){
+	struct TLBEntry * set = mm->tlb[virtual_page_id & (TLB_SETS - 1)];
+	for(int i = 0; i < TLB_WAYS; i++){
+		if(set[i].virtual_page_id == virtual_page_id)
+			set[i].virtual_page_id = -1;
+	}
+}
+
+static void tlb_flush(struct MMStruct * mm){
+	for(int i = 0; i < TLB_SETS; i++){
+		for(int j = 0; j < TLB_WAYS; j++)
+			mm->tlb[i][j].virtual_page_id = -1;
+		mm->tlb_next[i] = 0;
+	}
+}
+
+static void page_table_free(void * table, int level){
+	if(table != NULL && level > 0){
+		for(int i = 0; i < PAGE_TABLE_ENTRIES; i++)
+			page_table_free(((void **)table)[i], level - 1);
+	}
+	free(level == 0 && table_is_huge(table) ? huge_pte(table) : table);
+}
+
+// Unlink an entry from the LRU queue.
+static void lru_unlink(struct LRU * lru, struct LRUEntry * entry){
+	if(entry->prev == NULL)
+		lru->head = entry->next;
+	else
+		entry->prev->next = entry->next;
+	if(entry->next == NULL)
+		lru->tail = entry->prev;
+	else
+		entry->next->prev = entry->prev;
+	entry->next = NULL;
+	entry->prev = NULL;
+	lru->num_entries -= 1;
+}
+
+// Append an entry to the tail of the LRU queue.
+static void lru_append(struct LRU * lru, struct LRUEntry * entry){
+	entry->next = NULL;
+	entry->prev = lru->tail;
+	if(lru->tail != NULL)
+		lru->tail->next = entry;
+	else
+		lru->head = entry;
+	lru->tail = entry;
+	lru->num_entries += 1;
+}
+
+// The queue of the kernel an LRUEntry on a given QUEUE_* is linked in.
+static struct LRU * lru_queue(struct Kernel * kernel, int queue){
+	switch(queue){
+	case QUEUE_RECENT:
+		return &kernel->lru_recent;
+	case QUEUE_GHOST_RECENT:
+		return &kernel->ghost_recent;
+	case QUEUE_GHOST_FREQUENT:
+		return &kernel->ghost_frequent;
+	default:
+		return &kernel->lru;
+	}
+}
+
+// Number of pages in kernel-managed memory, except the pages pinned by vm_map_span.
+static int resident_pages(struct Kernel * kernel){
+	return kernel->lru.num_entries + kernel->lru_recent.num_entries;
+}
+
+// Walk the resident pages in the order they are printed: lru_recent first, then lru.
+static struct LRUEntry * lru_walk_next(struct Kernel * kernel, struct LRUEntry * entry){
+	if(entry == NULL)
+		return kernel->lru_recent.head != NULL ? kernel->lru_recent.head : kernel->lru.head;
+	if(entry->next == NULL && entry->queue == QUEUE_RECENT)
+		return kernel->lru.head;
+	return entry->next;
+}
+
+/*
+        Ghost entries remember the (pid, virtual_page_id) of recently evicted pages, so 2Q and ARC can tell
+        a page that comes back soon after its eviction from a page seen for the first time.
+        A ghost left behind by an exited process is harmless: it only affects which queue a page joins and ages out.
+*/
+static int ghost_bucket(struct Kernel * kernel, int pid, long virtual_page_id){
+	return (unsigned long)(pid * 2654435761u ^ virtual_page_id * 40503u) % kernel->ghost_capacity;
+}
+
+// Remove a ghost entry from its queue and from the hash table, and return it to the pool.
+static void ghost_del(struct Kernel * kernel, struct LRUEntry * ghost){
+	struct LRUEntry ** link = &kernel->ghost_hash[ghost_bucket(kernel, ghost->pid, ghost->virtual_page_id)];
+	while(*link != ghost)
+		link = &(*link)->hash_next;
+	*link = ghost->hash_next;
+	lru_unlink(lru_queue(kernel, ghost->queue), ghost);
+	ghost->next = kernel->ghost_free;
+	kernel->ghost_free = ghost;
+}
+
+// Find the ghost entry of a page, NULL if the page was not evicted recently.
+static struct LRUEntry * ghost_find(struct Kernel * kernel, int pid, long virtual_page_id){
+	struct LRUEntry * ghost = kernel->ghost_hash[ghost_bucket(kernel, pid, virtual_page_id)];
+	while(ghost != NULL && (ghost->pid != pid || ghost->virtual_page_id != virtual_page_id))
+		ghost = ghost->hash_next;
+	return ghost;
+}
+
+// Remember an evicted page at the tail of a ghost queue. When the pool is empty the oldest ghost of the longer queue is dropped.
+static void ghost_add(struct Kernel * kernel, int queue, int pid, long virtual_page_id){
+	if(kernel->ghost_free == NULL){
+		if(kernel->ghost_recent.num_entries >= kernel->ghost_frequent.num_entries)
+			ghost_del(kernel, kernel->ghost_recent.head);
+		else
+			ghost_del(kernel, kernel->ghost_frequent.head);
+	}
+	struct LRUEntry * ghost = kernel->ghost_free;
+	kernel->ghost_free = ghost->next;
+	ghost->pid = pid;
+	ghost->virtual_page_id = virtual_page_id;
+	ghost->queue = queue;
+	int bucket = ghost_bucket(kernel, pid, virtual_page_id);
+	ghost->hash_next = kernel->ghost_hash[bucket];
+	kernel->ghost_hash[bucket] = ghost;
+	lru_append(lru_queue(kernel, queue), ghost);
+}
+
+/*
+        A page replacement policy decides which resident page lru_del evicts.
+        miss:   called before a page (pid, virtual_page_id) is brought into kernel-managed memory, before any eviction.
+                Returns a hint passed to victim and insert (the ghost queue the page was found on, -1 if none).
+        hit:    called when a resident page is accessed again, NULL if the policy does no work on a hit.
+        insert: put the entry of a page just brought into kernel-managed memory on a queue.
+        victim: unlink the entry of the page to evict from its queue and return its PFN.
+*/
+struct ReplacementPolicy {
+	const char * name;
+	int (*miss)(struct Kernel * kernel, int pid, long virtual_page_id);
+	void (*hit)(struct Kernel * kernel, struct LRUEntry * entry);
+	void (*insert)(struct Kernel * kernel, struct LRUEntry * entry, int hint);
+	int (*victim)(struct Kernel * kernel, int hint);
+};
+
+// Evict the entry at the head of a queue, remembering it on a ghost queue if ghost_queue != -1.
+static int evict_head(struct Kernel * kernel, struct LRU * lru, int ghost_queue){
+	struct LRUEntry * entry = lru->head;
+	lru_unlink(lru, entry);
+	if(ghost_queue != -1)
+		ghost_add(kernel, ghost_queue, entry->pid, entry->virtual_page_id);
+	return entry - kernel->lru_entries;
+}
+
+// LRU: a hit moves the page to the tail, the head is evicted.
+static void lru_policy_hit(struct Kernel * kernel, struct LRUEntry * entry){
+	if(entry->next != NULL){
+		lru_unlink(&kernel->lru, entry);
+		lru_append(&kernel->lru, entry);
+	}
+}
+
+static void lru_policy_insert(struct Kernel * kernel, struct LRUEntry * entry, int hint){
+	(void)hint;
+	entry->queue = QUEUE_FREQUENT;
+	lru_append(&kernel->lru, entry);
+}
+
+static int lru_policy_victim(struct Kernel * kernel, int hint){
+	(void)hint;
+	return evict_head(kernel, &kernel->lru, -1);
+}
+
+// CLOCK: the head of kernel->lru is the clock hand. A referenced page gets a second chance by moving behind the hand.
+static int clock_policy_victim(struct Kernel * kernel, int hint){
+	(void)hint;
+	while(1){
+		struct LRUEntry * entry = kernel->lru.head;
+		if(!page_referenced(kernel, entry))
+			return evict_head(kernel, &kernel->lru, -1);
+		lru_unlink(&kernel->lru, entry);
+		lru_append(&kernel->lru, entry);
+	}
+}
+
+// 2Q: a page seen again while on A1out goes to Am, any other new page to A1in.
+static int twoq_policy_miss(struct Kernel * kernel, int pid, long virtual_page_id){
+	struct LRUEntry * ghost = ghost_find(kernel, pid, virtual_page_id);
+	if(ghost == NULL)
+		return -1;
+	ghost_del(kernel, ghost);
+	return QUEUE_GHOST_RECENT;
+}
+
+// A hit on A1in does nothing (correlated references), a hit on Am moves the page to its tail.
+static void twoq_policy_hit(struct Kernel * kernel, struct LRUEntry * entry){
+	if(entry->queue == QUEUE_FREQUENT)
+		lru_policy_hit(kernel, entry);
+}
+
+static void twoq_policy_insert(struct Kernel * kernel, struct LRUEntry * entry, int hint){
+	entry->queue = hint == -1 ? QUEUE_RECENT : QUEUE_FREQUENT;
+	lru_append(lru_queue(kernel, entry->queue), entry);
+}
+
+// Evict from A1in while it is over its share (remembering the page on A1out, which holds at most half the frames), else from Am.
+static int twoq_policy_victim(struct Kernel * kernel, int hint){
+	(void)hint;
+	if(kernel->lru_recent.num_entries > kernel->target_recent || kernel->lru.num_entries == 0){
+		int pfn = evict_head(kernel, &kernel->lru_recent, QUEUE_GHOST_RECENT);
+		if(kernel->ghost_recent.num_entries > max(1, KERNEL_SPACE_SIZE / PAGE_SIZE / 2))
+			ghost_del(kernel, kernel->ghost_recent.head);
+		return pfn;
+	}
+	return evict_head(kernel, &kernel->lru, -1);
+}
+
+// ARC: a ghost hit on B1 grows the target size of T1, a ghost hit on B2 shrinks it. Both bring the page into T2.
+static int arc_policy_miss(struct Kernel * kernel, int pid, long virtual_page_id){
+	int frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+	int b1 = kernel->ghost_recent.num_entries;
+	int b2 = kernel->ghost_frequent.num_entries;
+	struct LRUEntry * ghost = ghost_find(kernel, pid, virtual_page_id);
+	if(ghost != NULL){
+		int queue = ghost->queue;
+		if(queue == QUEUE_GHOST_RECENT)
+			kernel->target_recent = min(frames, kernel->target_recent + max(1, b2 / b1));
+		else
+			kernel->target_recent = max(0, kernel->target_recent - max(1, b1 / b2));
+		ghost_del(kernel, ghost);
+		return queue;
+	}
+
+	// A new page: keep |T1| + |B1| <= frames and the whole directory <= 2 * frames.
+	if(kernel->lru_recent.num_entries + b1 >= frames){
+		if(b1 > 0)
+			ghost_del(kernel, kernel->ghost_recent.head);
+	}
+	else if(resident_pages(kernel) + b1 + b2 >= 2 * frames && b2 > 0)
+		ghost_del(kernel, kernel->ghost_frequent.head);
+	return -1;
+}
+
+static void arc_policy_hit(struct Kernel * kernel, struct LRUEntry * entry){
+	lru_unlink(lru_queue(kernel, entry->queue), entry);
+	entry->queue = QUEUE_FREQUENT;
+	lru_append(&kernel->lru, entry);
+}
+
+static void arc_policy_insert(struct Kernel * kernel, struct LRUEntry * entry, int hint){
+	entry->queue = hint == -1 ? QUEUE_RECENT : QUEUE_FREQUENT;
+	lru_append(lru_queue(kernel, entry->queue), entry);
+}
+
+static int arc_policy_victim(struct Kernel * kernel, int hint){
+	int t1 = kernel->lru_recent.num_entries;
+	if(t1 > 0 && (t1 > kernel->target_recent || (hint == QUEUE_GHOST_FREQUENT && t1 == kernel->target_recent) || kernel->lru.num_entries == 0)){
+		// When T1 fills all frames and a new page joins it, there is no room left in B1 for the evicted page.
+		int remember = hint != -1 || t1 + kernel->ghost_recent.num_entries < KERNEL_SPACE_SIZE / PAGE_SIZE;
+		return evict_head(kernel, &kernel->lru_recent, remember ? QUEUE_GHOST_RECENT : -1);
+	}
+	return evict_head(kernel, &kernel->lru, QUEUE_GHOST_FREQUENT);
+}
+
+// Indexed by the POLICY_* values.
+static const struct ReplacementPolicy policies[] = {
+	{ "LRU", NULL, lru_policy_hit, lru_policy_insert, lru_policy_victim },
+	{ "CLOCK", NULL, NULL, lru_policy_insert, clock_policy_victim },
+	{ "2Q", twoq_policy_miss, twoq_policy_hit, twoq_policy_insert, twoq_policy_victim },
+	{ "ARC", arc_policy_miss, arc_policy_hit, arc_policy_insert, arc_policy_victim },
+};
 
 struct Kernel * init_kernel(){
+	// PFNs must fit in a PTE below PTE_PFN_NONE, and there must be at least one page.
+	if(PAGE_SIZE <= 0 || KERNEL_SPACE_SIZE < PAGE_SIZE || (long)(KERNEL_SPACE_SIZE / PAGE_SIZE) >= (long)PTE_PFN_NONE) {
+		printf("invalid kernel space size in init_kernel\n");
+		exit(-1);
+	}
 	struct Kernel * kernel = (struct Kernel *)malloc(sizeof(struct Kernel));
 
 	kernel->space = (char *)malloc(sizeof(char) * KERNEL_SPACE_SIZE);
-	kernel->occupied_pages = (char *)malloc(sizeof(char) * KERNEL_SPACE_SIZE / PAGE_SIZE);
+	kernel->space_mapped = 0;
+	bitmap_init(&kernel->occupied_pages, KERNEL_SPACE_SIZE / PAGE_SIZE);
+	buddy_init(&kernel->buddy, KERNEL_SPACE_SIZE / PAGE_SIZE);
 	kernel->si = (struct SwapInfoStruct *)malloc(sizeof(struct SwapInfoStruct));
-	kernel->running = (char *)malloc(sizeof(char) * MAX_PROCESS_NUM);
-	kernel->mm = (struct MMStruct *)malloc(sizeof(struct MMStruct) * MAX_PROCESS_NUM);
+	kernel->num_mm = MAX_PROCESS_NUM + MAX_SHARED_REGIONS;
+	kernel->running = (char *)malloc(sizeof(char) * kernel->num_mm);
+	kernel->mm = (struct MMStruct *)malloc(sizeof(struct MMStruct) * kernel->num_mm);
 
-	// Initialize the memory mappings manager for each process.
-	for(int i = 0; i < MAX_PROCESS_NUM; i ++) {
+	// Initialize the memory mappings manager for each process and each shared region.
+	for(int i = 0; i < kernel->num_mm; i ++) {
 		kernel->mm[i].page_table = NULL;
+		kernel->mm[i].shared = NULL;
+		kernel->mm[i].via = -1;
+		kernel->mm[i].num_pending_hits = 0;
+		pthread_mutex_init(&kernel->mm[i].lock, NULL);
 	}
+	kernel->shared_regions = (struct SharedRegion *)calloc(MAX_SHARED_REGIONS, sizeof(struct SharedRegion));
+	pthread_mutex_init(&kernel->shared_lock, NULL);
 
 	// Initialize the swap area manager.
-	kernel->si->swap_map = (char *)malloc(sizeof(char) * MAX_PROCESS_NUM * VIRTUAL_SPACE_SIZE / PAGE_SIZE);
+	long swap_space_size = SWAP_SPACE_SIZE > 0 ? SWAP_SPACE_SIZE : kernel->num_mm * VIRTUAL_SPACE_SIZE;
+	if(swap_space_size < PAGE_SIZE || swap_space_size / PAGE_SIZE >= (long)PTE_PFN_NONE) {
+		printf("invalid swap space size in init_kernel\n");
+		exit(-1);
+	}
+	bitmap_init(&kernel->si->swap_map, swap_space_size / PAGE_SIZE);
 	kernel->si->swapper_space = (int *)malloc(sizeof(int) * KERNEL_SPACE_SIZE / PAGE_SIZE);
-	memset(kernel->si->swap_map, 0, sizeof(char) * MAX_PROCESS_NUM * VIRTUAL_SPACE_SIZE / PAGE_SIZE);
 	for(int i = 0; i < KERNEL_SPACE_SIZE / PAGE_SIZE; i++) {
 		kernel->si->swapper_space[i] = -1;
 	}
+	kernel->si->swap_count = (int *)calloc(swap_space_size / PAGE_SIZE, sizeof(int));
+	kernel->si->swap_cache = (int *)malloc(sizeof(int) * (swap_space_size / PAGE_SIZE));
+	for(int i = 0; i < swap_space_size / PAGE_SIZE; i++) {
+		kernel->si->swap_cache[i] = -1;
+	}
+	kernel->si->zswap = NULL;
+	kernel->si->zswap_length = NULL;
+	kernel->si->zswap_used = 0;
+	if(ZSWAP_POOL_SIZE > 0) {
+		kernel->si->zswap = (unsigned char **)calloc(swap_space_size / PAGE_SIZE, sizeof(unsigned char *));
+		kernel->si->zswap_length = (int *)calloc(swap_space_size / PAGE_SIZE, sizeof(int));
+	}
 
 	kernel->lru.num_entries = 0;
 	kernel->lru.head = NULL;
 	kernel->lru.tail = NULL;
+	kernel->lru_entries = (struct LRUEntry *)malloc(sizeof(struct LRUEntry) * KERNEL_SPACE_SIZE / PAGE_SIZE);
+	kernel->page_mapcount = (int *)calloc(KERNEL_SPACE_SIZE / PAGE_SIZE, sizeof(int));
+	kernel->page_pins = (int *)calloc(KERNEL_SPACE_SIZE / PAGE_SIZE, sizeof(int));
+	kernel->pinned_pages = 0;
+	for(int i = 0; i < KERNEL_SPACE_SIZE / PAGE_SIZE; i++) {
+		kernel->lru_entries[i].rmap = NULL;
+	}
+
+	// Initialize the page replacement policy and its queues.
+	if(PAGE_REPLACEMENT_POLICY < 0 || PAGE_REPLACEMENT_POLICY >= (int)(sizeof(policies) / sizeof(policies[0]))) {
+		printf("unknown page replacement policy %d in init_kernel\n", PAGE_REPLACEMENT_POLICY);
+		exit(-1);
+	}
+	kernel->policy = &policies[PAGE_REPLACEMENT_POLICY];
+	memset(&kernel->lru_recent, 0, sizeof(struct LRU));
+	memset(&kernel->ghost_recent, 0, sizeof(struct LRU));
+	memset(&kernel->ghost_frequent, 0, sizeof(struct LRU));
+	kernel->ghost_capacity = 2 * KERNEL_SPACE_SIZE / PAGE_SIZE;
+	kernel->ghost_entries = (struct LRUEntry *)malloc(sizeof(struct LRUEntry) * kernel->ghost_capacity);
+	kernel->ghost_hash = (struct LRUEntry **)calloc(kernel->ghost_capacity, sizeof(struct LRUEntry *));
+	kernel->ghost_free = NULL;
+	for(int i = kernel->ghost_capacity - 1; i >= 0; i--) {
+		kernel->ghost_entries[i].next = kernel->ghost_free;
+		kernel->ghost_free = &kernel->ghost_entries[i];
+	}
+	// 2Q keeps A1in at a quarter of the frames, ARC starts with no preference for T1.
+	kernel->target_recent = PAGE_REPLACEMENT_POLICY == POLICY_2Q ? max(1, KERNEL_SPACE_SIZE / PAGE_SIZE / 4) : 0;
 
 	memset(kernel->space, 0, sizeof(char) * KERNEL_SPACE_SIZE);
-	memset(kernel->occupied_pages, 0, KERNEL_SPACE_SIZE / PAGE_SIZE);
-	memset(kernel->running, 0, MAX_PROCESS_NUM);
+	memset(kernel->running, 0, kernel->num_mm);
 
 	// Create swap file and fill the content with 0.
-	FILE * f = fopen("swap", "wb");
-	if(f == NULL) {
+	// Resizing the file with ftruncate reads back as 0 without writing it, so this does not depend on the swap size.
+	// A reused swap file keeps its old content, which is never read: a swap file page is always written before it is read.
+	kernel->si->path = strdup(SWAP_FILE_PATH);
+	kernel->si->size = (size_t)swap_space_size;
+	kernel->si->fd = open(kernel->si->path, SWAP_FILE_REUSE ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(kernel->si->fd == -1) {
 		printf("error opening swap in init_kernel\n");
 		exit(-1);
 	}
-	for(int j = 0; j < VIRTUAL_SPACE_SIZE * MAX_PROCESS_NUM; j ++)
-		putc(0, f);
-	fclose(f);
+	if(ftruncate(kernel->si->fd, kernel->si->size) == -1) {
+		printf("error resizing swap in init_kernel\n");
+		exit(-1);
+	}
+	if(SWAP_FILE_PREALLOCATE && posix_fallocate(kernel->si->fd, 0, kernel->si->size) != 0) {
+		printf("error allocating swap in init_kernel\n");
+		exit(-1);
+	}
+	kernel->si->map = NULL;
+	if(SWAP_BACKEND == SWAP_BACKEND_MMAP) {
+		kernel->si->map = (char *)mmap(NULL, kernel->si->size, PROT_READ | PROT_WRITE, MAP_SHARED, kernel->si->fd, 0);
+		if(kernel->si->map == MAP_FAILED) {
+			printf("error mapping swap in init_kernel\n");
+			exit(-1);
+		}
+	}
+
+	pthread_mutex_init(&kernel->lru_lock, NULL);
+	pthread_mutex_init(&kernel->frame_lock, NULL);
+	pthread_mutex_init(&kernel->swap_lock, NULL);
+	kernel->free_pages = KERNEL_SPACE_SIZE / PAGE_SIZE;
+	memset(&kernel->stats, 0, sizeof(struct PagingStats));
+
+	// Start the background reclaim thread if a high watermark is set.
+	pthread_mutex_init(&kernel->kswapd_lock, NULL);
+	pthread_cond_init(&kernel->kswapd_wait, NULL);
+	kernel->high_watermark = min(RECLAIM_HIGH_WATERMARK, KERNEL_SPACE_SIZE / PAGE_SIZE);
+	kernel->low_watermark = min(RECLAIM_LOW_WATERMARK, kernel->high_watermark);
+	pthread_mutex_init(&kernel->checkpoint_lock, NULL);
+	pthread_cond_init(&kernel->checkpoint_wait, NULL);
+	kernel->checkpointing = 0;
+	kernel->running_accesses = 0;
+	kernel->kswapd_running = kernel->high_watermark > 0;
+	if(kernel->kswapd_running) {
+		if(pthread_create(&kernel->kswapd, NULL, kswapd, kernel) != 0) {
+			printf("error starting kswapd in init_kernel\n");
+			exit(-1);
+		}
+	}
 
 	return kernel;
 }
 
 void destroy_kernel(struct Kernel * kernel){
-	while(kernel->lru.num_entries != 0)
-		lru_del(kernel);
+	if(kernel->kswapd_running) {
+		pthread_mutex_lock(&kernel->kswapd_lock);
+		kernel->kswapd_running = 0;
+		pthread_cond_signal(&kernel->kswapd_wait);
+		pthread_mutex_unlock(&kernel->kswapd_lock);
+		pthread_join(kernel->kswapd, NULL);
+	}
+	reclaim(kernel, KERNEL_SPACE_SIZE / PAGE_SIZE - kernel->free_pages, -1, -1, 0);
+	for(int i = 0; i < kernel->num_mm; i ++)
+		pthread_mutex_destroy(&kernel->mm[i].lock);
+	pthread_mutex_destroy(&kernel->shared_lock);
+	pthread_mutex_destroy(&kernel->lru_lock);
+	pthread_mutex_destroy(&kernel->frame_lock);
+	pthread_mutex_destroy(&kernel->swap_lock);
+	pthread_mutex_destroy(&kernel->kswapd_lock);
+	pthread_cond_destroy(&kernel->kswapd_wait);
+	pthread_mutex_destroy(&kernel->checkpoint_lock);
+	pthread_cond_destroy(&kernel->checkpoint_wait);
 
-	free(kernel->space);
-	free(kernel->occupied_pages);
+	if(kernel->space_mapped)
+		munmap(kernel->space, KERNEL_SPACE_SIZE);
+	else
+		free(kernel->space);
+	bitmap_free(&kernel->occupied_pages);
+	buddy_free_lists(&kernel->buddy);
+	free(kernel->lru_entries);
+	free(kernel->page_mapcount);
+	free(kernel->page_pins);
+	free(kernel->ghost_entries);
+	free(kernel->ghost_hash);
 	free(kernel->running);
-	for(int i = 0; i < MAX_PROCESS_NUM; i ++){
+	for(int i = 0; i < kernel->num_mm; i ++){
 		if(kernel->mm[i].page_table != NULL)
-			free(kernel->mm[i].page_table);
+			page_table_free(kernel->mm[i].page_table, kernel->mm[i].levels - 1);
+		while(kernel->mm[i].shared != NULL){
+			struct SharedMapping * mapping = kernel->mm[i].shared;
+			kernel->mm[i].shared = mapping->next;
+			free(mapping);
+		}
 	}
+	for(int i = 0; i < MAX_SHARED_REGIONS; i ++)
+		free(kernel->shared_regions[i].name);
+	free(kernel->shared_regions);
 	free(kernel->mm);
-	free(kernel->si->swap_map);
+	bitmap_free(&kernel->si->swap_map);
 	free(kernel->si->swapper_space);
+	free(kernel->si->swap_count);
+	free(kernel->si->swap_cache);
+	if(kernel->si->zswap != NULL) {
+		for(size_t i = 0; i < kernel->si->size / PAGE_SIZE; i++)
+			free(kernel->si->zswap[i]);
+		free(kernel->si->zswap);
+		free(kernel->si->zswap_length);
+	}
+	if(kernel->si->map != NULL) {
+		if(SWAP_MSYNC_ON_DESTROY)
+			msync(kernel->si->map, kernel->si->size, MS_SYNC);
+		munmap(kernel->si->map, kernel->si->size);
+	}
+	close(kernel->si->fd);
+	free(kernel->si->path);
 	free(kernel->si);
 	free(kernel);
 }
 
 void print_kernel_free_space(struct Kernel * kernel){
+	pthread_mutex_lock(&kernel->frame_lock);
 	int idx = 0;
 	char * addr = kernel->space;
 	printf("free space: ");
 	while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE){
-		while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE && kernel->occupied_pages[idx] == 1){
+		while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE && bitmap_test(&kernel->occupied_pages, idx) == 1){
 			++ idx;
 			addr += PAGE_SIZE;
 		}
 		int last = idx;
-		while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE && kernel->occupied_pages[idx] == 0)
+		while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE && bitmap_test(&kernel->occupied_pages, idx) == 0)
 			++ idx;
 		if(idx < KERNEL_SPACE_SIZE / PAGE_SIZE)
 			printf("(addr:%d, size:%d) -> ", (int)(addr - kernel->space), (idx - last) * PAGE_SIZE);
@@ -94,19 +918,21 @@ void print_kernel_free_space(struct Kernel * kernel){
 			printf("(addr:%d, size:%d)\n", (int)(addr - kernel->space), (idx - last) * PAGE_SIZE);
 		addr += PAGE_SIZE * (idx - last);
 	}
+	pthread_mutex_unlock(&kernel->frame_lock);
 }
 
 void get_kernel_free_space_info(struct Kernel * kernel, char * buf){
+	pthread_mutex_lock(&kernel->frame_lock);
 	int i = sprintf(buf, "free space: ");
 	int idx = 0;
 	char * addr = kernel->space;
 	while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE){
-		while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE && kernel->occupied_pages[idx] == 1){
+		while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE && bitmap_test(&kernel->occupied_pages, idx) == 1){
 			++ idx;
 			addr += PAGE_SIZE;
 		}
 		int last = idx;
-		while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE && kernel->occupied_pages[idx] == 0)
+		while(idx < KERNEL_SPACE_SIZE / PAGE_SIZE && bitmap_test(&kernel->occupied_pages, idx) == 0)
 			++ idx;
 		int n;
 		if(idx < KERNEL_SPACE_SIZE / PAGE_SIZE)
@@ -116,260 +942,1718 @@ void get_kernel_free_space_info(struct Kernel * kernel, char * buf){
 		i += n;
 		addr += PAGE_SIZE * (idx - last);
 	}
+	pthread_mutex_unlock(&kernel->frame_lock);
+}
+
+// Apply the hits each process has batched up (see LRU_HIT_BATCH), so the queues are in the order of the accesses.
+// The caller holds no lock.
+static void apply_all_hits(struct Kernel * kernel){
+	if(kernel->policy->hit == NULL)
+		return;
+	for(int i = 0; i < kernel->num_mm; i++){
+		pthread_mutex_lock(&kernel->mm[i].lock);
+		if(kernel->mm[i].num_pending_hits > 0){
+			pthread_mutex_lock(&kernel->lru_lock);
+			apply_hits(kernel, i);
+			pthread_mutex_unlock(&kernel->lru_lock);
+		}
+		pthread_mutex_unlock(&kernel->mm[i].lock);
+	}
+}
+
+// Apply the hits the other processes have batched up before a victim is chosen, so that the policy sees their accesses
+// too and not only those of the faulting process. A process busy in another thread is skipped: its hits are applied
+// with its next full batch or fault. The caller holds lru_lock, and the lock of process pid (-1 if none).
+static void apply_hits_before_reclaim(struct Kernel * kernel, int pid){
+	if(kernel->policy->hit == NULL)
+		return;
+	for(int i = 0; i < kernel->num_mm; i++){
+		if(i == pid){
+			apply_hits(kernel, i);
+			continue;
+		}
+		if(pthread_mutex_trylock(&kernel->mm[i].lock) != 0)
+			continue;
+		apply_hits(kernel, i);
+		pthread_mutex_unlock(&kernel->mm[i].lock);
+	}
 }
 
 void print_kernel_lru(struct Kernel * kernel){
+	apply_all_hits(kernel);
+	pthread_mutex_lock(&kernel->lru_lock);
 	printf("Kernel LRU: ");
-	if(kernel->lru.num_entries == 0) {
+	if(resident_pages(kernel) == 0) {
 		printf("\n");
+		pthread_mutex_unlock(&kernel->lru_lock);
 		return;
 	}
-	struct LRUEntry * temp = kernel->lru.head;
+	struct LRUEntry * temp = lru_walk_next(kernel, NULL);
 	while(temp != NULL){
-		if(temp->next == NULL)
-			printf("(pid:%d, page:%d)\n", temp->pid, temp->virtual_page_id);
+		struct LRUEntry * next = lru_walk_next(kernel, temp);
+		if(next == NULL)
+			printf("(pid:%d, page:%ld)\n", temp->pid, temp->virtual_page_id);
 		else
-			printf("(pid:%d, page:%d) -> ", temp->pid, temp->virtual_page_id);
-		temp = temp->next;
+			printf("(pid:%d, page:%ld) -> ", temp->pid, temp->virtual_page_id);
+		temp = next;
 	}
+	pthread_mutex_unlock(&kernel->lru_lock);
 }
 
 void get_kernel_lru_info(struct Kernel * kernel, char * buf){
+	apply_all_hits(kernel);
+	pthread_mutex_lock(&kernel->lru_lock);
 	int i = 0;
-	if(kernel->lru.num_entries == 0)
+	if(resident_pages(kernel) == 0){
+		pthread_mutex_unlock(&kernel->lru_lock);
 		return;
-	struct LRUEntry * temp = kernel->lru.head;
+	}
+	struct LRUEntry * temp = lru_walk_next(kernel, NULL);
 	while(temp != NULL){
-		if(temp->next == NULL){
-			int n = sprintf(buf + i, "(pid:%d, page:%d)", temp->pid, temp->virtual_page_id);
+		struct LRUEntry * next = lru_walk_next(kernel, temp);
+		if(next == NULL){
+			int n = sprintf(buf + i, "(pid:%d, page:%ld)", temp->pid, temp->virtual_page_id);
 			i += n;
 		}
 		else{
-			int n = sprintf(buf + i, "(pid:%d, page:%d) -> ", temp->pid, temp->virtual_page_id);
+			int n = sprintf(buf + i, "(pid:%d, page:%ld) -> ", temp->pid, temp->virtual_page_id);
 			i += n;
 		}
-		temp = temp->next;
+		temp = next;
+	}
+	pthread_mutex_unlock(&kernel->lru_lock);
+}
+
+static void print_mapping(long virtual_page_id, struct PTE * pte, void * arg){
+	long * next = (long *)arg;
+	// The virtual pages whose tables are not allocated were never accessed.
+	if(*next < virtual_page_id)
+		printf("virtual page %ld-%ld: Not present\n", *next, virtual_page_id - 1);
+	*next = virtual_page_id + 1;
+	if(pte_bits(pte) & PTE_HUGE) {
+		long last = virtual_page_id + HUGE_PAGE_PAGES - 1;
+		*next = last + 1;
+		if(!pte_present(pte) && pte_pfn(pte) == -1)
+			printf("virtual page %ld-%ld: Not present\n", virtual_page_id, last);
+		else
+			printf("virtual page %ld-%ld -> %s page %d-%d (huge page)\n", virtual_page_id, last, pte_present(pte) ? "physical" : "swap file",
+				pte_pfn(pte), pte_pfn(pte) + HUGE_PAGE_PAGES - 1);
+	}
+	else if(!pte_present(pte)) {
+		if(pte_pfn(pte) == -1)
+			printf("virtual page %ld: Not present\n", virtual_page_id);
+		else
+			printf("virtual page %ld -> swap file page %d\n", virtual_page_id, pte_pfn(pte));
 	}
+	else
+		printf("virtual page %ld -> physical page %d\n", virtual_page_id, pte_pfn(pte));
 }
 
 void print_memory_mappings(struct Kernel * kernel, int pid){
+	pthread_mutex_lock(&kernel->mm[pid].lock);
 	if(kernel->running[pid] == 0) {
 		printf("The process is not running\n");
 	}
 	else {
 		printf("Memory mappings of process %d\n", pid);
-		for(int i = 0; i < (kernel->mm[pid].size + PAGE_SIZE - 1) / PAGE_SIZE; i++) {
-			if(kernel->mm[pid].page_table[i].present == 0) {
-				if(kernel->mm[pid].page_table[i].PFN == -1)
-					printf("virtual page %d: Not present\n", i);
-				else
-					printf("virtual page %d -> swap file page %d\n", i, kernel->mm[pid].page_table[i].PFN);
-			}
-			else
-				printf("virtual page %d -> physical page %d\n", i, kernel->mm[pid].page_table[i].PFN);
-		}
+		long next = 0; // The virtual pages before next are printed.
+		pte_for_each(&kernel->mm[pid], print_mapping, &next);
+		if(next < num_virtual_pages(&kernel->mm[pid]))
+			printf("virtual page %ld-%ld: Not present\n", next, num_virtual_pages(&kernel->mm[pid]) - 1);
+		// The pages of a shared region are mapped in its own slot, instead of the pages of the process above.
+		for(struct SharedMapping * mapping = kernel->mm[pid].shared; mapping != NULL; mapping = mapping->next)
+			printf("virtual page %ld-%ld -> shared region %s\n", mapping->start, mapping->start + mapping->num_pages - 1, kernel->shared_regions[mapping->region].name);
 	}
 	printf("\n");
+	pthread_mutex_unlock(&kernel->mm[pid].lock);
 }
 
-void lru_del(struct Kernel * kernel){
-	if(kernel->lru.num_entries != 0){
-		int pid = kernel->lru.head->pid;
-		int virtual_page_id = kernel->lru.head->virtual_page_id;
-		int pfn = kernel->mm[pid].page_table[virtual_page_id].PFN;
-
-		int swap_page_id;
-		// If the page is dirty, write to the swap file.
-		if(kernel->mm[pid].page_table[virtual_page_id].dirty == 1){
-			// Need to persist the page back to disk.
-			FILE * f = fopen("swap", "r+");
-			if(f == NULL) {
-				printf("error opening swap in lru_del\n");
-				exit(-1);
-			}
+int get_tlb_info(struct Kernel * kernel, int pid, long * hits, long * misses){
+	if(pid < 0 || pid >= MAX_PROCESS_NUM)
+		return -1;
+	pthread_mutex_lock(&kernel->mm[pid].lock);
+	int ret = -1;
+	if(kernel->running[pid] == 1){
+		*hits = kernel->mm[pid].tlb_hits;
+		*misses = kernel->mm[pid].tlb_misses;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&kernel->mm[pid].lock);
+	return ret;
+}
 
-			// Find the swap file page to write.
-			swap_page_id = kernel->si->swapper_space[pfn];
-			if(swap_page_id == -1) {
-				// If this pfn is not a swapped-in page, find a new not-occupied swap file page.
-				swap_page_id = 0;
-				while(kernel->si->swap_map[swap_page_id] == 1)
-					swap_page_id++;
-				kernel->si->swap_map[swap_page_id] = 1;
-			}
+void get_kernel_stats(struct Kernel * kernel, struct PagingStats * stats){
+	stats->minor_faults = __atomic_load_n(&kernel->stats.minor_faults, __ATOMIC_RELAXED);
+	stats->major_faults = __atomic_load_n(&kernel->stats.major_faults, __ATOMIC_RELAXED);
+	stats->evictions = __atomic_load_n(&kernel->stats.evictions, __ATOMIC_RELAXED);
+	stats->write_backs = __atomic_load_n(&kernel->stats.write_backs, __ATOMIC_RELAXED);
+	stats->swap_ins = __atomic_load_n(&kernel->stats.swap_ins, __ATOMIC_RELAXED);
+	stats->swap_slots = __atomic_load_n(&kernel->stats.swap_slots, __ATOMIC_RELAXED);
+	stats->bytes_copied = __atomic_load_n(&kernel->stats.bytes_copied, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&kernel->frame_lock);
+	stats->resident_pages = KERNEL_SPACE_SIZE / PAGE_SIZE - kernel->free_pages;
+	pthread_mutex_unlock(&kernel->frame_lock);
+}
 
-			// Set the write position.
-			fseek(f, swap_page_id * PAGE_SIZE, SEEK_SET);
-			fwrite(kernel->space + PAGE_SIZE * pfn, sizeof(char), sizeof(char) * PAGE_SIZE, f);
-			memset(kernel->space + PAGE_SIZE * pfn, 0, PAGE_SIZE);
-			fclose(f);
-		}
-		else{
-			swap_page_id = kernel->si->swapper_space[pfn];
-			if(swap_page_id == -1) {
-				// If this pfn is not a swapped-in page, find a new not-occupied swap file page.
-				swap_page_id = 0;
-				while(kernel->si->swap_map[swap_page_id] == 1)
-					swap_page_id++;
-				kernel->si->swap_map[swap_page_id] = 1;
-				FILE * f = fopen("swap", "r+");
-				if(f == NULL) {
-					printf("error opening swap in lru_del\n");
-					exit(-1);
-				}
-				fseek(f, swap_page_id * PAGE_SIZE, SEEK_SET);
-				fwrite(kernel->space + PAGE_SIZE * pfn, sizeof(char), sizeof(char) * PAGE_SIZE, f);
-				memset(kernel->space + PAGE_SIZE * pfn, 0, PAGE_SIZE);
-				fclose(f);
-			}
-		}
+int get_proc_stats(struct Kernel * kernel, int pid, struct PagingStats * stats){
+	if(pid < 0 || pid >= MAX_PROCESS_NUM)
+		return -1;
+	pthread_mutex_lock(&kernel->mm[pid].lock);
+	int ret = -1;
+	if(kernel->running[pid] == 1){
+		*stats = kernel->mm[pid].stats;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&kernel->mm[pid].lock);
+	return ret;
+}
+
+// FNV-1a hash of length bytes following bytes whose hash is hash, so that data in pieces hashes as a whole.
+static uint64_t hash_more(uint64_t hash, const void * data, size_t length){
+	for(size_t i = 0; i < length; i++){
+		hash ^= ((const unsigned char *)data)[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// FNV-1a hash of length bytes.
+static uint64_t hash_bytes(const void * data, size_t length){
+	return hash_more(14695981039346656037ull, data, length);
+}
+
+// Read num_pages consecutive swap file pages starting at swap_page_id from the swap file, with a single preadv.
+static void swap_file_read_pages(struct Kernel * kernel, int swap_page_id, struct iovec * iov, int num_pages){
+	if(kernel->si->map != NULL) {
+		for(int i = 0; i < num_pages; i++)
+			memcpy(iov[i].iov_base, kernel->si->map + (size_t)(swap_page_id + i) * PAGE_SIZE, PAGE_SIZE);
+	}
+	else if(preadv(kernel->si->fd, iov, num_pages, (off_t)swap_page_id * PAGE_SIZE) != (ssize_t)num_pages * PAGE_SIZE) {
+		printf("error reading swap file pages %d-%d\n", swap_page_id, swap_page_id + num_pages - 1);
+		exit(-1);
+	}
+}
 
-		kernel->occupied_pages[pfn] = 0; // Release the occupied page.
+/*
+        Compress a page for zswap into dst (PAGE_SIZE bytes) with run-length encoding, which suits the mostly
+        repetitive pages evicted. A control byte c < 128 is followed by c + 1 literal bytes, and c >= 128 by one byte
+        repeated c - 125 times. Return the length, or -1 if it is not smaller than the page.
+*/
+static int zswap_compress(const unsigned char * src, unsigned char * dst){
+	int n = 0;
+	int i = 0;
+	while(i < PAGE_SIZE){
+		int run = 1;
+		while(i + run < PAGE_SIZE && run < 130 && src[i + run] == src[i])
+			run++;
+		if(run >= 3){
+			if(n + 2 >= PAGE_SIZE)
+				return -1;
+			dst[n++] = run + 125;
+			dst[n++] = src[i];
+			i += run;
+			continue;
+		}
+		// Literals up to the next run of 3 equal bytes.
+		int len = 0;
+		while(i + len < PAGE_SIZE && len < 128 && !(i + len + 2 < PAGE_SIZE && src[i + len] == src[i + len + 1] && src[i + len] == src[i + len + 2]))
+			len++;
+		if(n + 1 + len >= PAGE_SIZE)
+			return -1;
+		dst[n++] = len - 1;
+		memcpy(dst + n, src + i, len);
+		n += len;
+		i += len;
+	}
+	return n;
+}
 
-		kernel->mm[pid].page_table[virtual_page_id].present = 0;
-		kernel->mm[pid].page_table[virtual_page_id].dirty = 0;
-		kernel->mm[pid].page_table[virtual_page_id].PFN = swap_page_id; // Map to swap file page id.
-		
-		// Delete the head of the LRU queue.
-		struct LRUEntry * temp = kernel->lru.head;
-		if(temp->next == NULL){
-			kernel->lru.head = NULL;
-			kernel->lru.tail = NULL;
+static void zswap_decompress(const unsigned char * src, int length, unsigned char * dst){
+	for(int i = 0; i < length; ){
+		int c = src[i++];
+		if(c < 128){
+			memcpy(dst, src + i, c + 1);
+			dst += c + 1;
+			i += c + 1;
 		}
-		else{
-			kernel->lru.head = temp->next;
-			kernel->lru.head->prev = NULL;
+		else {
+			memset(dst, src[i++], c - 125);
+			dst += c - 125;
 		}
-		kernel->lru.num_entries -= 1;
-		free(temp);
 	}
 }
 
-// Add an entry to LRU.
-// 	1. If the entry is already in the LRU, move it to the tail.
-//	2. If the entry is not in the LRU, append it to the tail.
-void lru_add(struct Kernel * kernel, int pid, int virtual_page_id){
-	// First to find if the entry exists.
-	if(kernel->lru.num_entries > 0){
-		struct LRUEntry * cur = kernel->lru.head;
-		while(cur != NULL){
-			if(cur->pid == pid && cur->virtual_page_id == virtual_page_id){
-				if(kernel->lru.num_entries == 1 || cur->next == NULL)
-					return;
-
-				if(cur->prev == NULL){
-					kernel->lru.head = cur->next;
-					kernel->lru.head->prev = NULL;
-				}
-				else
-					cur->prev->next = cur->next;
-				cur->next->prev = cur->prev;
-				kernel->lru.tail->next = cur;
-				cur->next = NULL;
-				cur->prev = kernel->lru.tail;
-				kernel->lru.tail = cur;
-				return;
+// Free the compressed content of a swap file page in the zswap pool, if any. The caller holds swap_lock.
+static void zswap_drop(struct Kernel * kernel, int swap_page_id){
+	if(kernel->si->zswap == NULL || kernel->si->zswap[swap_page_id] == NULL)
+		return;
+	free(kernel->si->zswap[swap_page_id]);
+	kernel->si->zswap[swap_page_id] = NULL;
+	kernel->si->zswap_used -= kernel->si->zswap_length[swap_page_id];
+}
+
+// Add n to a counter of struct Kernel, which other threads update without a common lock.
+static inline void stat_add(long * counter, long n){
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Read num_pages consecutive swap file pages starting at swap_page_id. Those in the zswap pool are decompressed,
+// and each run of the others is read from the swap file at once.
+// The caller holds a reference to the swap file pages, so their zswap content does not change.
+static void swap_read_pages(struct Kernel * kernel, int swap_page_id, struct iovec * iov, int num_pages){
+	stat_add(&kernel->stats.swap_ins, num_pages);
+	if(kernel->si->zswap == NULL) {
+		swap_file_read_pages(kernel, swap_page_id, iov, num_pages);
+		return;
+	}
+	int start = 0;
+	for(int i = 0; i <= num_pages; i++){
+		unsigned char * data = i < num_pages ? kernel->si->zswap[swap_page_id + i] : NULL;
+		if(i < num_pages && data == NULL)
+			continue;
+		if(i > start)
+			swap_file_read_pages(kernel, swap_page_id + start, iov + start, i - start);
+		if(data != NULL)
+			zswap_decompress(data, kernel->si->zswap_length[swap_page_id + i], (unsigned char *)iov[i].iov_base);
+		start = i + 1;
+	}
+}
+
+// Write num_pages pages to consecutive swap file pages starting at swap_page_id, with a single pwritev.
+static void swap_write_pages(struct Kernel * kernel, int swap_page_id, struct iovec * iov, int num_pages){
+	if(kernel->si->map != NULL) {
+		for(int i = 0; i < num_pages; i++)
+			memcpy(kernel->si->map + (size_t)(swap_page_id + i) * PAGE_SIZE, iov[i].iov_base, PAGE_SIZE);
+		return;
+	}
+	if(pwritev(kernel->si->fd, iov, num_pages, (off_t)swap_page_id * PAGE_SIZE) != (ssize_t)num_pages * PAGE_SIZE) {
+		printf("error writing swap file pages %d-%d\n", swap_page_id, swap_page_id + num_pages - 1);
+		exit(-1);
+	}
+}
+
+// Drop a reference to each of num_pages consecutive swap file pages (see swap_count), and free those it was the last one of.
+// The caller holds swap_lock.
+static void swap_put_pages(struct Kernel * kernel, int swap_page_id, int num_pages){
+	int num_freed = 0;
+	for(int i = swap_page_id; i < swap_page_id + num_pages; i++){
+		if(--kernel->si->swap_count[i] > 0)
+			continue;
+		bitmap_clear(&kernel->si->swap_map, i);
+		kernel->si->swap_cache[i] = -1;
+		zswap_drop(kernel, i);
+		num_freed++;
+	}
+	stat_add(&kernel->stats.swap_slots, -num_freed);
+}
+
+// Drop a reference to a swap file page, see swap_put_pages.
+static void swap_put(struct Kernel * kernel, int swap_page_id){
+	swap_put_pages(kernel, swap_page_id, 1);
+}
+
+// Make page pfn of kernel-managed memory forget its swap file page (swapper_space). The caller holds swap_lock.
+static void swap_detach(struct Kernel * kernel, int pfn){
+	int swap_page_id = kernel->si->swapper_space[pfn];
+	if(swap_page_id == -1)
+		return;
+	kernel->si->swapper_space[pfn] = -1;
+	if(kernel->si->swap_cache[swap_page_id] == pfn)
+		kernel->si->swap_cache[swap_page_id] = -1;
+	swap_put(kernel, swap_page_id);
+}
+
+// Release pages of kernel-managed memory.
+static int compare_int(const void * a, const void * b){
+	return *(const int *)a - *(const int *)b;
+}
+
+// Free pages of kernel-managed memory (pfns is sorted in place). Each run of consecutive pages is freed as the largest
+// aligned blocks it holds, so a huge page or the pages of an exiting process go back to the buddy allocator at once.
+static void free_frames(struct Kernel * kernel, int * pfns, int num_pages){
+	qsort(pfns, num_pages, sizeof(int), compare_int);
+	pthread_mutex_lock(&kernel->frame_lock);
+	for(int i = 0; i < num_pages; ){
+		int run = 1;
+		while(i + run < num_pages && pfns[i + run] == pfns[i] + run)
+			run++;
+		for(int pfn = pfns[i]; pfn < pfns[i] + run; ){
+			int k = 0;
+			while(k < BUDDY_MAX_ORDER && pfn % (2 << k) == 0 && pfn + (2 << k) <= pfns[i] + run)
+				k++;
+			buddy_free(kernel, pfn, k);
+			pfn += 1 << k;
+		}
+		i += run;
+	}
+	pthread_mutex_unlock(&kernel->frame_lock);
+}
+
+// A page chosen for eviction and the swap file page it goes to.
+struct SwapOut {
+	int pfn;
+	int swap_page_id;
+};
+
+static int compare_swap_out(const void * a, const void * b){
+	return ((const struct SwapOut *)a)->swap_page_id - ((const struct SwapOut *)b)->swap_page_id;
+}
+
+// Store the pages to write back in the zswap pool while it has room, and return how many of them are left
+// for the swap file (moved to the front of pages). The previous content of their swap file pages is dropped.
+static int zswap_store_pages(struct Kernel * kernel, struct SwapOut * pages, int num_pages){
+	unsigned char * buf = (unsigned char *)malloc(PAGE_SIZE);
+	int num_left = 0;
+	for(int i = 0; i < num_pages; i++){
+		int length = zswap_compress((unsigned char *)kernel->space + PAGE_SIZE * pages[i].pfn, buf);
+		pthread_mutex_lock(&kernel->swap_lock);
+		zswap_drop(kernel, pages[i].swap_page_id);
+		if(length != -1 && kernel->si->zswap_used + length <= ZSWAP_POOL_SIZE){
+			unsigned char * data = (unsigned char *)malloc(length);
+			memcpy(data, buf, length);
+			kernel->si->zswap[pages[i].swap_page_id] = data;
+			kernel->si->zswap_length[pages[i].swap_page_id] = length;
+			kernel->si->zswap_used += length;
+		}
+		else
+			pages[num_left++] = pages[i];
+		pthread_mutex_unlock(&kernel->swap_lock);
+	}
+	free(buf);
+	return num_left;
+}
+
+// Write pages back to the swap file, and store the swap file page each one went to in pages[i].swap_page_id.
+// The caller holds the locks of the processes mapping the pages. A new swap file page has no reference (swap_count) yet.
+//	1. A swapped-in page (swap_page_id != -1) that is not dirty is still up to date in the swap file and is not written.
+//	2. Pages without a swap file page get a run of consecutive free swap file pages when there is one.
+//	3. The pages that compress go to the zswap pool while it has room (ZSWAP_POOL_SIZE).
+//	4. The others are sorted by swap file page, and each run of consecutive ones is written with one pwritev.
+static void write_back(struct Kernel * kernel, struct SwapOut * pages, int num_pages){
+	struct SwapOut * to_write = (struct SwapOut *)malloc(sizeof(struct SwapOut) * max(1, num_pages));
+	int num_new = 0;
+	for(int i = 0; i < num_pages; i++){
+		if(pages[i].swap_page_id == -1)
+			num_new++;
+	}
+
+	// Find swap file pages for the pages that do not have one, contiguous if possible.
+	pthread_mutex_lock(&kernel->swap_lock);
+	int cluster = num_new > 1 ? bitmap_find_zero_run(&kernel->si->swap_map, num_new) : -1;
+	int num_write = 0;
+	for(int i = 0; i < num_pages; i++){
+		struct LRUEntry * entry = &kernel->lru_entries[pages[i].pfn];
+		if(pages[i].swap_page_id == -1){
+			if(cluster != -1)
+				pages[i].swap_page_id = cluster++;
+			else
+				pages[i].swap_page_id = bitmap_find_first_zero(&kernel->si->swap_map);
+			if(pages[i].swap_page_id == -1) {
+				printf("swap file is full in lru_del\n");
+				exit(-1);
 			}
-			cur = cur->next;
-		}
-	}
-
-	// If LRU is full, pop one entry.
-	if(kernel->lru.num_entries >= KERNEL_SPACE_SIZE / PAGE_SIZE)
-		lru_del(kernel);
-	for(int i = 0; i < KERNEL_SPACE_SIZE / PAGE_SIZE; i ++){
-		if(kernel->occupied_pages[i] == 0){
-			if(kernel->mm[pid].page_table[virtual_page_id].present == 0 && kernel->mm[pid].page_table[virtual_page_id].PFN != -1) {
-				// The page is in the swap file.
-				FILE * f = fopen("swap", "r+");
-				if(f == NULL) {
-					printf("error opening swap in lru_add\n");
-					exit(-1);
-				}
-				fseek(f, kernel->mm[pid].page_table[virtual_page_id].PFN * PAGE_SIZE, SEEK_SET);
-				fread(kernel->space + PAGE_SIZE * i, sizeof(char), sizeof(char) * PAGE_SIZE, f);
-				fclose(f);
-
-				// Update SwapInfoStruct (map PFN to the swapped-in page).
-				kernel->si->swapper_space[i] = kernel->mm[pid].page_table[virtual_page_id].PFN;
+			bitmap_set(&kernel->si->swap_map, pages[i].swap_page_id);
+			stat_add(&kernel->stats.swap_slots, 1);
+		}
+		else if(!pte_dirty(entry_pte(kernel, entry)))
+			continue;
+		to_write[num_write++] = pages[i];
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+	stat_add(&kernel->stats.write_backs, num_write);
+	for(int i = 0; i < num_write; i++)
+		kernel->mm[kernel->lru_entries[to_write[i].pfn].pid].stats.write_backs++;
+	if(kernel->si->zswap != NULL)
+		num_write = zswap_store_pages(kernel, to_write, num_write);
+
+	// Write the pages back in runs of consecutive swap file pages.
+	qsort(to_write, num_write, sizeof(struct SwapOut), compare_swap_out);
+	struct iovec * iov = (struct iovec *)malloc(sizeof(struct iovec) * (min(num_write, IOV_MAX) + 1));
+	for(int i = 0; i < num_write; ){
+		int n = 0;
+		do {
+			iov[n].iov_base = kernel->space + PAGE_SIZE * to_write[i + n].pfn;
+			iov[n].iov_len = PAGE_SIZE;
+			n++;
+		} while(i + n < num_write && n < IOV_MAX && to_write[i + n].swap_page_id == to_write[i].swap_page_id + n);
+		swap_write_pages(kernel, to_write[i].swap_page_id, iov, n);
+		i += n;
+	}
+	free(iov);
+	free(to_write);
+}
+
+// Make sure the caller holds the lock of process owner. pid is the process whose lock the caller already holds (-1 if none),
+// along with the one of the process accessing it if it is a shared region, and locked[] marks the locks taken here.
+// Only trylock is used, since the caller may hold other locks.
+static int lock_owner(struct Kernel * kernel, char * locked, int owner, int pid){
+	if(owner == pid || (pid != -1 && owner == kernel->mm[pid].via) || locked[owner])
+		return 1;
+	if(pthread_mutex_trylock(&kernel->mm[owner].lock) != 0)
+		return 0;
+	locked[owner] = 1;
+	return 1;
+}
+
+static void unlock_owners(struct Kernel * kernel, char * locked){
+	for(int i = 0; i < kernel->num_mm; i++){
+		if(locked[i])
+			pthread_mutex_unlock(&kernel->mm[i].lock);
+	}
+}
+
+// Lock the processes mapping the page of an LRUEntry, see lock_owner.
+static int lock_mappers(struct Kernel * kernel, char * locked, struct LRUEntry * entry, int pid){
+	if(!lock_owner(kernel, locked, entry->pid, pid))
+		return 0;
+	for(struct RMap * rmap = entry->rmap; rmap != NULL; rmap = rmap->next){
+		if(!lock_owner(kernel, locked, rmap->pid, pid))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+        Map the block of a huge page of process pid (at virtual page virtual_page_id) with a last-level table instead:
+        1. A resident huge page becomes HUGE_PAGE_PAGES pages, its first page keeps the LRUEntry of the huge page,
+           and the others go on the queues and the local list of the process (the huge page was charged for them).
+        2. A huge page in the swap file becomes the PTEs of its swap file pages.
+        3. A huge page not yet built becomes PTEs not yet built.
+        The caller holds the lock of process pid and lru_lock.
+*/
+static void split_huge_page(struct Kernel * kernel, int pid, long virtual_page_id){
+	struct MMStruct * mm = &kernel->mm[pid];
+	void ** slot = table_slot(mm, virtual_page_id, 0);
+	struct PTE * huge = huge_pte(*slot);
+	int pfn = pte_pfn(huge);
+	uint32_t flags = pte_bits(huge) & ~(PTE_PFN_NONE | PTE_HUGE);
+	struct PTE * table = (struct PTE *)malloc(sizeof(struct PTE) * PAGE_TABLE_ENTRIES);
+	for(int i = 0; i < HUGE_PAGE_PAGES; i++){
+		if(pfn == -1){
+			pte_set(&table[i], -1, 0);
+			continue;
+		}
+		pte_set(&table[i], pfn + i, flags);
+		if((flags & PTE_PRESENT) && i > 0){
+			kernel->page_mapcount[pfn + i] = 1;
+			kernel->policy->insert(kernel, &kernel->lru_entries[pfn + i], -1);
+			local_append(&mm->local, &kernel->lru_entries[pfn + i]);
+		}
+	}
+	*slot = table;
+	free(huge);
+	tlb_flush(mm);
+}
+
+// Put a victim that cannot be evicted now back on the queues, and forget the ghost entry the policy may have made for it.
+static void putback(struct Kernel * kernel, struct LRUEntry * entry){
+	struct LRUEntry * ghost = ghost_find(kernel, entry->pid, entry->virtual_page_id);
+	if(ghost != NULL)
+		ghost_del(kernel, ghost);
+	kernel->policy->insert(kernel, entry, -1);
+}
+
+// Take the victim of a local reclaim of process pid off the queues: the first page on its local list that is not pinned,
+// and not referenced since it was last passed over (such a page moves to the tail, like on the CLOCK ring).
+// The policy is not asked, so no ghost entry is made. Return its PFN, -1 if there is none. The caller holds lru_lock.
+static int local_victim(struct Kernel * kernel, int pid){
+	struct LRU * local = &kernel->mm[pid].local;
+	for(int tries = 2 * local->num_entries; tries > 0; tries--){
+		struct LRUEntry * entry = local->head;
+		local_unlink(local, entry);
+		local_append(local, entry);
+		if(entry->queue == QUEUE_PINNED || page_referenced(kernel, entry))
+			continue;
+		lru_unlink(lru_queue(kernel, entry->queue), entry);
+		return entry - kernel->lru_entries;
+	}
+	return -1;
+}
+
+// Take victims of the policy off the queues (or of local_victim, for a local reclaim of process pid), up to num_pages
+// pages of kernel-managed memory, uncharge them, and lock the processes mapping them. A victim with a process locked by
+// another thread is put back, and each resident page is tried at most once.
+// A victim leaves the swap cache, so no process maps it any more. Return the number of victims.
+// A huge page needs consecutive swap file pages: it keeps those it was read from, or takes a run of free ones
+// (marked dirty, so write_back writes them), and is split and put back when there is no such run.
+static int isolate_pages(struct Kernel * kernel, struct SwapOut * out, int num_pages, int hint, int pid, int local, char * locked){
+	pthread_mutex_lock(&kernel->lru_lock);
+	apply_hits_before_reclaim(kernel, pid);
+	int n = 0;
+	int taken = 0;
+	int tries = local ? kernel->mm[pid].local.num_entries : resident_pages(kernel);
+	while(taken < num_pages && tries-- > 0){
+		int pfn = local ? local_victim(kernel, pid) : kernel->policy->victim(kernel, n == 0 ? hint : -1);
+		if(pfn == -1)
+			break;
+		struct LRUEntry * entry = &kernel->lru_entries[pfn];
+		if(!lock_mappers(kernel, locked, entry, pid)){
+			putback(kernel, entry);
+			continue;
+		}
+		int m = entry_pages(kernel, entry);
+		pthread_mutex_lock(&kernel->swap_lock);
+		int swap_page_id = kernel->si->swapper_space[pfn];
+		if(m > 1 && swap_page_id == -1){
+			swap_page_id = bitmap_find_zero_run(&kernel->si->swap_map, m);
+			if(swap_page_id == -1){
+				pthread_mutex_unlock(&kernel->swap_lock);
+				split_huge_page(kernel, entry->pid, entry->virtual_page_id);
+				putback(kernel, entry);
+				continue;
 			}
-			else {
-				// The mapping has not yet been built.
-				kernel->mm[pid].page_table[virtual_page_id].present = 1;
+			for(int i = 0; i < m; i++){
+				bitmap_set(&kernel->si->swap_map, swap_page_id + i);
+				kernel->si->swap_count[swap_page_id + i] = 1;
+				kernel->si->swapper_space[pfn + i] = swap_page_id + i;
 			}
+			stat_add(&kernel->stats.swap_slots, m);
+			pte_set_flags(entry_pte(kernel, entry), PTE_DIRTY);
+		}
+		if(swap_page_id != -1 && kernel->si->swap_cache[swap_page_id] == pfn)
+			kernel->si->swap_cache[swap_page_id] = -1;
+		pthread_mutex_unlock(&kernel->swap_lock);
+		charge_del(kernel, entry, m);
+		out[n].pfn = pfn;
+		out[n].swap_page_id = swap_page_id;
+		n++;
+		taken += m;
+	}
+	pthread_mutex_unlock(&kernel->lru_lock);
+	return n;
+}
 
-			kernel->mm[pid].page_table[virtual_page_id].PFN = i;
-			kernel->mm[pid].page_table[virtual_page_id].present = 1;
+// Whether num_pages pages of kernel-managed memory from pfn are all zero: the first byte is zero and each byte equals
+// the next one, which memcmp checks a word (or vector) at a time.
+static int page_is_zero(struct Kernel * kernel, int pfn, int num_pages){
+	char * page = kernel->space + PAGE_SIZE * pfn;
+	return page[0] == 0 && memcmp(page, page + 1, (size_t)PAGE_SIZE * num_pages - 1) == 0;
+}
+
+// Map a PTE of an evicted page to its swap file page (-1 for a zero page).
+static void unmap_page(struct Kernel * kernel, int pid, long virtual_page_id, int swap_page_id){
+	pte_set(pte_walk(&kernel->mm[pid], virtual_page_id, 0), swap_page_id, 0);
+	tlb_invalidate(&kernel->mm[pid], virtual_page_id);
+	kernel->mm[pid].stats.resident_pages--;
+	if(swap_page_id != -1)
+		kernel->mm[pid].stats.swap_slots++;
+}
 
-			kernel->occupied_pages[i] = 1;
+// Evict pages chosen by the policy, up to num_pages pages of kernel-managed memory (a huge page may go past it), and
+// return how many were evicted. hint is passed to the first victim.
+// pid is the process whose lock the caller holds, -1 if none. With local, only the pages charged to it are evicted
+// (see local_victim). The swap I/O is done holding only process locks.
+static int reclaim(struct Kernel * kernel, int num_pages, int hint, int pid, int local){
+	if(num_pages <= 0)
+		return 0;
 
-			// Append the new entry to the tail of the LRU.
-			struct LRUEntry * temp = (struct LRUEntry *)malloc(sizeof(struct LRUEntry));
-			temp->pid = pid;
-			temp->virtual_page_id = virtual_page_id;
-			temp->next = NULL;
-			if(kernel->lru.tail != NULL){
-				temp->prev = kernel->lru.tail;
-				kernel->lru.tail->next = temp;
-				kernel->lru.tail = temp;
-			}
-			else{
-				kernel->lru.head = temp;
-				kernel->lru.tail = temp;
-				kernel->lru.head->prev = NULL;
-				kernel->lru.head->next = NULL;
-				kernel->lru.tail->prev = NULL;
-				kernel->lru.tail->next = NULL;
+	char * locked = (char *)calloc(kernel->num_mm, sizeof(char));
+	struct SwapOut * out = (struct SwapOut *)malloc(sizeof(struct SwapOut) * num_pages);
+	int n = isolate_pages(kernel, out, num_pages, hint, pid, local, locked);
+	int * sizes = (int *)malloc(sizeof(int) * max(1, n));
+	int num_frames = 0;
+	for(int i = 0; i < n; i++){
+		sizes[i] = entry_pages(kernel, &kernel->lru_entries[out[i].pfn]);
+		num_frames += sizes[i];
+	}
+
+	// Zero pages are not written: their PTEs are left unmapped, like pages never accessed, and read as zero again.
+	// They go to the end of out.
+	int num_write = n;
+	for(int i = 0; i < num_write; ){
+		if(page_is_zero(kernel, out[i].pfn, sizes[i])){
+			struct SwapOut zero = out[i];
+			int size = sizes[i];
+			out[i] = out[--num_write];
+			sizes[i] = sizes[num_write];
+			out[num_write] = zero;
+			sizes[num_write] = size;
+		}
+		else
+			i++;
+	}
+
+	// A huge page is written as its pages, to its consecutive swap file pages.
+	struct SwapOut * pages = (struct SwapOut *)malloc(sizeof(struct SwapOut) * max(1, num_frames));
+	int num_pages_write = 0;
+	for(int i = 0; i < num_write; i++){
+		for(int k = 0; k < sizes[i]; k++){
+			pages[num_pages_write].pfn = out[i].pfn + k;
+			pages[num_pages_write].swap_page_id = sizes[i] == 1 ? out[i].swap_page_id : out[i].swap_page_id + k;
+			num_pages_write++;
+		}
+	}
+	write_back(kernel, pages, num_pages_write);
+	for(int i = 0, k = 0; i < num_write; k += sizes[i++])
+		out[i].swap_page_id = pages[k].swap_page_id;
+	free(pages);
+
+	// Map the PTEs of the pages to their swap file pages, then release the pages.
+	int * pfns = (int *)malloc(sizeof(int) * max(1, num_frames));
+	int num_freed = 0;
+	pthread_mutex_lock(&kernel->swap_lock);
+	for(int i = 0; i < n; i++){
+		int pfn = out[i].pfn;
+		int swap_page_id = i < num_write ? out[i].swap_page_id : -1;
+		struct LRUEntry * entry = &kernel->lru_entries[pfn];
+		struct MMStruct * mm = &kernel->mm[entry->pid];
+		mm->stats.evictions += sizes[i];
+		if(sizes[i] > 1){
+			// A huge page is mapped by its process alone, and its swap file pages pass from its pages to its PTE.
+			pte_set(entry_pte(kernel, entry), swap_page_id, PTE_HUGE);
+			tlb_flush(mm);
+			mm->stats.resident_pages -= sizes[i];
+			if(swap_page_id != -1)
+				mm->stats.swap_slots += sizes[i];
+			for(int k = 0; k < sizes[i]; k++){
+				if(swap_page_id == -1)
+					swap_detach(kernel, pfn + k);
+				kernel->si->swapper_space[pfn + k] = -1;
+				pfns[num_freed++] = pfn + k;
 			}
-			kernel->lru.num_entries += 1;
+			kernel->page_mapcount[pfn] = 0;
+			continue;
+		}
+		unmap_page(kernel, entry->pid, entry->virtual_page_id, swap_page_id);
+		while(entry->rmap != NULL){
+			struct RMap * rmap = entry->rmap;
+			unmap_page(kernel, rmap->pid, rmap->virtual_page_id, swap_page_id);
+			entry->rmap = rmap->next;
+			free(rmap);
+		}
+		// The PTEs now hold the swap file page instead of the page.
+		if(swap_page_id == -1)
+			swap_detach(kernel, pfn);
+		else
+			kernel->si->swap_count[swap_page_id] += kernel->page_mapcount[pfn] - (kernel->si->swapper_space[pfn] != -1);
+		kernel->si->swapper_space[pfn] = -1;
+		kernel->page_mapcount[pfn] = 0;
+		pfns[num_freed++] = pfn;
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+	stat_add(&kernel->stats.evictions, num_freed);
+	free_frames(kernel, pfns, num_freed);
+	free(pfns);
+
+	unlock_owners(kernel, locked);
+	free(sizes);
+	free(out);
+	free(locked);
+	return num_freed;
+}
+
+// Write back the dirty pages among the next num_pages pages to evict (in the order of print_kernel_lru),
+// so that evicting them later does not need to write them. They stay resident and keep their swap file page.
+// Shared pages are left alone, they are not written while shared, and so are zero pages, which are never written,
+// and huge pages, which are written as a whole when evicted.
+static void clean_pages(struct Kernel * kernel, int num_pages){
+	char * locked = (char *)calloc(kernel->num_mm, sizeof(char));
+	struct SwapOut * pages = (struct SwapOut *)malloc(sizeof(struct SwapOut) * max(1, num_pages));
+	int n = 0;
+	int scanned = 0;
+	pthread_mutex_lock(&kernel->lru_lock);
+	for(struct LRUEntry * entry = lru_walk_next(kernel, NULL); entry != NULL && scanned < num_pages; entry = lru_walk_next(kernel, entry)){
+		int pfn = entry - kernel->lru_entries;
+		scanned++;
+		if(kernel->page_mapcount[pfn] == 1 && lock_owner(kernel, locked, entry->pid, -1) && entry_pages(kernel, entry) == 1
+				&& pte_dirty(entry_pte(kernel, entry)) && !page_is_zero(kernel, pfn, 1)){
+			pages[n].pfn = pfn;
+			pages[n].swap_page_id = kernel->si->swapper_space[pfn];
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&kernel->lru_lock);
+
+	write_back(kernel, pages, n);
+	pthread_mutex_lock(&kernel->swap_lock);
+	for(int i = 0; i < n; i++){
+		int pfn = pages[i].pfn;
+		if(kernel->si->swapper_space[pfn] == -1){
+			kernel->si->swapper_space[pfn] = pages[i].swap_page_id;
+			kernel->si->swap_count[pages[i].swap_page_id] = 1;
+			kernel->si->swap_cache[pages[i].swap_page_id] = pfn;
+		}
+		pte_clear_flags(entry_pte(kernel, &kernel->lru_entries[pfn]), PTE_DIRTY);
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+	unlock_owners(kernel, locked);
+	free(pages);
+	free(locked);
+}
+
+static int free_pages(struct Kernel * kernel){
+	pthread_mutex_lock(&kernel->frame_lock);
+	int n = kernel->free_pages;
+	pthread_mutex_unlock(&kernel->frame_lock);
+	return n;
+}
 
+/*
+        The background reclaim thread (kswapd) sleeps until the free pages of kernel-managed memory drop below
+        RECLAIM_LOW_WATERMARK, then evicts pages until RECLAIM_HIGH_WATERMARK pages are free, and writes back the dirty
+        pages among the next RECLAIM_HIGH_WATERMARK pages to evict. A fault then usually finds a free page, or a clean
+        page to evict, and does not wait for a write to the swap file.
+*/
+static void * kswapd(void * arg){
+	struct Kernel * kernel = (struct Kernel *)arg;
+	pthread_mutex_lock(&kernel->kswapd_lock);
+	while(kernel->kswapd_running){
+		int n = free_pages(kernel);
+		if(n >= kernel->low_watermark){
+			pthread_cond_wait(&kernel->kswapd_wait, &kernel->kswapd_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&kernel->kswapd_lock);
+		if(reclaim(kernel, kernel->high_watermark - n, -1, -1, 0) == 0)
+			sched_yield();
+		clean_pages(kernel, kernel->high_watermark);
+		pthread_mutex_lock(&kernel->kswapd_lock);
+	}
+	pthread_mutex_unlock(&kernel->kswapd_lock);
+	return NULL;
+}
+
+// Take num_pages free pages of kernel-managed memory (from the buddy allocator), evicting pages when there are not enough, and return
+// how many were taken. Only the first page is waited for: once nothing can be evicted, fewer pages are returned, since
+// threads each holding part of their pages while waiting for the rest could wait for each other forever.
+// The caller holds the lock of process pid.
+static int alloc_pages(struct Kernel * kernel, int * pfns, int num_pages, int hint, int pid){
+	int n = 0;
+	int left;
+	while(1){
+		pthread_mutex_lock(&kernel->frame_lock);
+		for(; n < num_pages && kernel->free_pages > 0; n++)
+			pfns[n] = buddy_alloc(kernel, 0);
+		left = kernel->free_pages;
+		pthread_mutex_unlock(&kernel->frame_lock);
+		if(n == num_pages)
 			break;
+
+		// If LRU is full, evict SWAP_CLUSTER_SIZE entries (or as many as still needed).
+		// Nothing is evicted when every resident page belongs to a process busy in another thread, so wait for one.
+		if(reclaim(kernel, max(max(1, SWAP_CLUSTER_SIZE), num_pages - n), hint, pid, 0) == 0){
+			if(n > 0)
+				break;
+			sched_yield();
+		}
+		hint = -1;
+	}
+
+	// Wake up the background reclaim thread when free pages run low.
+	if(kernel->kswapd_running && left < kernel->low_watermark){
+		pthread_mutex_lock(&kernel->kswapd_lock);
+		pthread_cond_signal(&kernel->kswapd_wait);
+		pthread_mutex_unlock(&kernel->kswapd_lock);
+	}
+	return n;
+}
+
+// Decide how many pages after a page faulted in from the swap file are read ahead with it.
+// Swap-in faults on consecutive virtual pages double the readahead window of the process (up to SWAP_READAHEAD_PAGES),
+// any other swap-in fault closes it. The pages read ahead must be in the swap file pages right after the faulting one,
+// and not in the swap cache.
+static int readahead_pages(struct Kernel * kernel, int pid, long virtual_page_id){
+	struct MMStruct * mm = &kernel->mm[pid];
+	if(virtual_page_id == mm->last_swap_in + 1)
+		mm->readahead_window = min(min(SWAP_READAHEAD_PAGES, KERNEL_SPACE_SIZE / PAGE_SIZE / 2), max(1, mm->readahead_window * 2));
+	else
+		mm->readahead_window = 0;
+
+	int swap_page_id = pte_pfn(pte_walk(mm, virtual_page_id, 0));
+	int n = 0;
+	pthread_mutex_lock(&kernel->swap_lock);
+	while(n < mm->readahead_window && virtual_page_id + n + 1 < num_virtual_pages(mm)){
+		struct PTE * next = pte_walk(mm, virtual_page_id + n + 1, 0);
+		if(next == NULL || (pte_bits(next) & (PTE_PRESENT | PTE_HUGE)) || pte_pfn(next) != swap_page_id + n + 1 || kernel->si->swap_cache[swap_page_id + n + 1] != -1)
+			break;
+		n++;
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+	// The next sequential fault is the one right after the pages read ahead.
+	mm->last_swap_in = virtual_page_id + n;
+	return n;
+}
+
+// Map a page in the swap cache for a process faulting on its swap file page, sharing it copy-on-write.
+// Return 1 when the swap file page is in the swap cache, 0 otherwise.
+static int map_swap_cache(struct Kernel * kernel, int pid, long virtual_page_id, struct PTE * pte){
+	int swap_page_id = pte_pfn(pte);
+	pthread_mutex_lock(&kernel->lru_lock);
+	pthread_mutex_lock(&kernel->swap_lock);
+	int pfn = kernel->si->swap_cache[swap_page_id];
+	if(pfn != -1){
+		swap_put(kernel, swap_page_id); // Not the last reference, the page holds one.
+		rmap_add(kernel, pfn, pid, virtual_page_id);
+		pte_set(pte, pfn, PTE_PRESENT | PTE_REFERENCED);
+		kernel->mm[pid].stats.swap_slots--;
+		kernel->mm[pid].stats.resident_pages++;
+		if(kernel->policy->hit != NULL)
+			kernel->policy->hit(kernel, &kernel->lru_entries[pfn]);
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+	pthread_mutex_unlock(&kernel->lru_lock);
+	return pfn != -1;
+}
+
+// Apply the hits a process has batched up to the policy, and move the pages to the tail of the local lists.
+// The caller holds the lock of the process and lru_lock.
+// While both are held the resident pages of the process are all on the queues, except those pinned by vm_map_span.
+static void apply_hits(struct Kernel * kernel, int pid){
+	struct MMStruct * mm = &kernel->mm[pid];
+	for(int i = 0; i < mm->num_pending_hits; i++){
+		struct PTE * pte = pte_walk(mm, mm->pending_hits[i], 0);
+		if(pte != NULL && pte_present(pte) && kernel->page_pins[pte_pfn(pte)] == 0){
+			struct LRUEntry * entry = &kernel->lru_entries[pte_pfn(pte)];
+			struct LRU * local = &kernel->mm[entry->pid].local;
+			kernel->policy->hit(kernel, entry);
+			local_unlink(local, entry);
+			local_append(local, entry);
 		}
 	}
+	mm->num_pending_hits = 0;
+}
+
+// Evict pages of process pid so that num_pages more can be charged to it without going over its quota.
+// The caller holds the lock of the process.
+static void charge_reserve(struct Kernel * kernel, int pid, long num_pages){
+	struct MMStruct * mm = &kernel->mm[pid];
+	if(mm->quota == 0)
+		return;
+	pthread_mutex_lock(&kernel->lru_lock);
+	long over = mm->charged + num_pages - mm->quota;
+	pthread_mutex_unlock(&kernel->lru_lock);
+	if(over > 0)
+		reclaim(kernel, over, -1, pid, 1);
+}
+
+static int compare_long(const void * a, const void * b){
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+	return x < y ? -1 : x > y;
+}
+
+// The page of slot that process pid accesses at its virtual page virtual_page_id (see lock_shared_page),
+// -1 if the page is in another slot. The caller holds the lock of process pid.
+static long slot_page(struct Kernel * kernel, int pid, int slot, long virtual_page_id){
+	for(struct SharedMapping * mapping = kernel->mm[pid].shared; mapping != NULL; mapping = mapping->next){
+		if(virtual_page_id >= mapping->start && virtual_page_id < mapping->start + mapping->num_pages)
+			return slot == MAX_PROCESS_NUM + mapping->region ? virtual_page_id - mapping->start : -1;
+	}
+	return slot == pid ? virtual_page_id : -1;
+}
+
+// Choose the pages of next (virtual page ids of the process accessing pid) to fault in with the num_pages pages of pid
+// in pages: those of pid that are not resident nor in the swap cache, up to a quarter of kernel-managed memory in all.
+// Append them to pages in order of virtual page id, and return how many were added.
+static int batch_pages(struct Kernel * kernel, int pid, long * pages, int num_pages, const long * next, int num_next){
+	struct MMStruct * mm = &kernel->mm[pid];
+	// A process with huge pages faults in whole blocks already, and walking its page table here would allocate
+	// huge pages not yet built.
+	if(mm->huge)
+		return 0;
+	int origin = mm->via != -1 ? mm->via : pid;
+	int limit = max(num_pages, KERNEL_SPACE_SIZE / PAGE_SIZE / 4);
+	int n = num_pages;
+	pthread_mutex_lock(&kernel->swap_lock);
+	for(int i = 0; i < num_next && n < limit; i++){
+		long virtual_page_id = slot_page(kernel, origin, pid, next[i]);
+		if(virtual_page_id == -1 || (virtual_page_id >= pages[0] && virtual_page_id < pages[0] + num_pages))
+			continue;
+		struct PTE * pte = pte_walk(mm, virtual_page_id, 1);
+		int swap_page_id = pte_pfn(pte);
+		if(pte_present(pte) || (swap_page_id != -1 && kernel->si->swap_cache[swap_page_id] != -1))
+			continue;
+		pages[n++] = virtual_page_id;
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+
+	// next may access a page more than once.
+	qsort(pages + num_pages, n - num_pages, sizeof(long), compare_long);
+	int m = num_pages;
+	for(int i = num_pages; i < n; i++){
+		if(m == num_pages || pages[i] != pages[m - 1])
+			pages[m++] = pages[i];
+	}
+	return m - num_pages;
+}
+
+/*
+        Fault in the huge page of pte, for virtual page virtual_page_id of process pid: take a block of HUGE_PAGE_PAGES
+        free pages, evicting pages first if fewer are free, and read its swap file pages into it at once (or zero-fill it).
+        The caller holds the lock of process pid. Return 1 when success, 0 when no block is free or the quota of the
+        process is smaller than a huge page.
+*/
+static int map_huge_page(struct Kernel * kernel, int pid, long virtual_page_id, struct PTE * pte, int hint){
+	struct MMStruct * mm = &kernel->mm[pid];
+	if(mm->quota > 0 && mm->quota < HUGE_PAGE_PAGES)
+		return 0;
+	charge_reserve(kernel, pid, HUGE_PAGE_PAGES);
+	pthread_mutex_lock(&kernel->frame_lock);
+	int pfn = buddy_alloc(kernel, HUGE_PAGE_ORDER);
+	int left = kernel->free_pages;
+	pthread_mutex_unlock(&kernel->frame_lock);
+	// Evicting pages does not help when enough are free, but not in one block.
+	if(pfn == -1 && left < HUGE_PAGE_PAGES && reclaim(kernel, HUGE_PAGE_PAGES - left, hint, pid, 0) > 0){
+		pthread_mutex_lock(&kernel->frame_lock);
+		pfn = buddy_alloc(kernel, HUGE_PAGE_ORDER);
+		pthread_mutex_unlock(&kernel->frame_lock);
+	}
+	if(pfn == -1)
+		return 0;
+
+	int swap_page_id = pte_pfn(pte);
+	if(swap_page_id == -1){
+		memset(kernel->space + PAGE_SIZE * (long)pfn, 0, (size_t)PAGE_SIZE * HUGE_PAGE_PAGES);
+		stat_add(&kernel->stats.minor_faults, 1);
+		mm->stats.minor_faults++;
+	}
+	else {
+		struct iovec * iov = (struct iovec *)malloc(sizeof(struct iovec) * HUGE_PAGE_PAGES);
+		for(int k = 0; k < HUGE_PAGE_PAGES; k++){
+			iov[k].iov_base = kernel->space + PAGE_SIZE * (long)(pfn + k);
+			iov[k].iov_len = PAGE_SIZE;
+		}
+		swap_read_pages(kernel, swap_page_id, iov, HUGE_PAGE_PAGES);
+		free(iov);
+		stat_add(&kernel->stats.major_faults, 1);
+		mm->stats.major_faults++;
+		mm->stats.swap_ins += HUGE_PAGE_PAGES;
+		mm->stats.swap_slots -= HUGE_PAGE_PAGES;
+	}
+	mm->stats.resident_pages += HUGE_PAGE_PAGES;
+
+	// Every page has an LRUEntry naming its virtual page (write_back uses it), only the first one goes on the queues.
+	// The references of the PTE to the swap file pages become the ones of the pages.
+	long first = virtual_page_id & ~(long)(HUGE_PAGE_PAGES - 1);
+	pthread_mutex_lock(&kernel->lru_lock);
+	pthread_mutex_lock(&kernel->swap_lock);
+	for(int k = 0; k < HUGE_PAGE_PAGES; k++){
+		kernel->lru_entries[pfn + k].pid = pid;
+		kernel->lru_entries[pfn + k].virtual_page_id = first + k;
+		kernel->si->swapper_space[pfn + k] = swap_page_id == -1 ? -1 : swap_page_id + k;
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+	kernel->page_mapcount[pfn] = 1;
+	pte_set(pte, pfn, PTE_HUGE | PTE_PRESENT | PTE_REFERENCED | PTE_WRITABLE);
+	kernel->policy->insert(kernel, &kernel->lru_entries[pfn], hint);
+	charge_add(kernel, &kernel->lru_entries[pfn], HUGE_PAGE_PAGES);
+	pthread_mutex_unlock(&kernel->lru_lock);
+	return 1;
+}
+
+// Add an entry to LRU.
+// 	1. If the entry is already in the LRU, move it to the tail.
+//	2. If the entry is not in the LRU, append it to the tail.
+// The queues are updated by the page replacement policy of the kernel. Hits are batched per process (LRU_HIT_BATCH)
+// so that lru_lock is not taken on every access, and the batch is applied before the process faults, and before any
+// victim is chosen (see apply_hits_before_reclaim).
+// A fault also brings in the pages of next that are not resident (see batch_pages), the pages the caller accesses next
+// (num_next of them, virtual page ids of the process accessing pid).
+// The caller holds the lock of process pid.
+// The tables of the page table on the way to the page are allocated on its first access.
+// A huge page is faulted in as a whole (map_huge_page), or split when that fails.
+// A process with a quota evicts its own pages first when the new ones would take it over (and brings in at most its quota).
+static struct PTE * map_page(struct Kernel * kernel, int pid, long virtual_page_id, const long * next, int num_next){
+	struct MMStruct * mm = &kernel->mm[pid];
+	struct PTE * pte = tlb_lookup(mm, virtual_page_id);
+	if(pte == NULL){
+		pte = pte_walk(mm, virtual_page_id, 1);
+		if(pte_present(pte))
+			tlb_insert(mm, virtual_page_id, pte);
+	}
+
+	// A present page is in the LRU, and its entry is the one of the page frame it occupies.
+	if(pte_present(pte)){
+		pte_set_flags(pte, PTE_REFERENCED);
+		if(kernel->policy->hit != NULL){
+			mm->pending_hits[mm->num_pending_hits++] = virtual_page_id;
+			if(mm->num_pending_hits == LRU_HIT_BATCH){
+				pthread_mutex_lock(&kernel->lru_lock);
+				apply_hits(kernel, pid);
+				pthread_mutex_unlock(&kernel->lru_lock);
+			}
+		}
+		return pte;
+	}
+
+	// The policy knows a huge page by its first page, like its LRUEntry.
+	int huge = (pte_bits(pte) & PTE_HUGE) != 0;
+	int hint = -1;
+	pthread_mutex_lock(&kernel->lru_lock);
+	apply_hits(kernel, pid);
+	if(kernel->policy->miss != NULL)
+		hint = kernel->policy->miss(kernel, pid, huge ? virtual_page_id & ~(long)(HUGE_PAGE_PAGES - 1) : virtual_page_id);
+	pthread_mutex_unlock(&kernel->lru_lock);
+
+	if(huge){
+		if(map_huge_page(kernel, pid, virtual_page_id, pte, hint)){
+			tlb_insert(mm, virtual_page_id, pte);
+			return pte;
+		}
+		pthread_mutex_lock(&kernel->lru_lock);
+		split_huge_page(kernel, pid, virtual_page_id);
+		pthread_mutex_unlock(&kernel->lru_lock);
+		pte = pte_walk(mm, virtual_page_id, 0);
+	}
+
+	// Another process may hold the page already.
+	int swap_page_id = pte_pfn(pte);
+	if(swap_page_id != -1 && map_swap_cache(kernel, pid, virtual_page_id, pte)){
+		stat_add(&kernel->stats.minor_faults, 1);
+		mm->stats.minor_faults++;
+		tlb_insert(mm, virtual_page_id, pte);
+		return pte;
+	}
+
+	// A page in the swap file may bring the next pages of the process with it, and the caller the pages it accesses next.
+	int num_pages = 1;
+	if(swap_page_id != -1)
+		num_pages += readahead_pages(kernel, pid, virtual_page_id);
+	long * pages = (long *)malloc(sizeof(long) * (num_pages + num_next));
+	for(int k = 0; k < num_pages; k++)
+		pages[k] = virtual_page_id + k;
+	num_pages += batch_pages(kernel, pid, pages, num_pages, next, num_next);
+	if(swap_page_id != -1){
+		stat_add(&kernel->stats.major_faults, 1);
+		mm->stats.major_faults++;
+	}
+	else {
+		stat_add(&kernel->stats.minor_faults, 1);
+		mm->stats.minor_faults++;
+	}
+
+	if(mm->quota > 0)
+		num_pages = min(num_pages, mm->quota);
+	charge_reserve(kernel, pid, num_pages);
+	int * pfns = (int *)malloc(sizeof(int) * num_pages);
+	num_pages = alloc_pages(kernel, pfns, num_pages, hint, pid);
+
+	struct iovec * iov = (struct iovec *)malloc(sizeof(struct iovec) * num_pages);
+	for(int k = 0; k < num_pages; k++){
+		iov[k].iov_base = kernel->space + PAGE_SIZE * pfns[k];
+		iov[k].iov_len = PAGE_SIZE;
+	}
+	for(int k = 0; k < num_pages; ){
+		int slot = pte_pfn(pte_walk(mm, pages[k], 0));
+		if(slot == -1) {
+			// The mapping has not yet been built, the page starts zero-filled.
+			memset(iov[k].iov_base, 0, PAGE_SIZE);
+			k++;
+			continue;
+		}
+		// Read each run of pages in consecutive swap file pages at once (the pages read ahead are one).
+		int n = 1;
+		while(k + n < num_pages && pte_pfn(pte_walk(mm, pages[k + n], 0)) == slot + n)
+			n++;
+		swap_read_pages(kernel, slot, iov + k, n);
+		k += n;
+	}
+	free(iov);
+
+	pthread_mutex_lock(&kernel->lru_lock);
+	pthread_mutex_lock(&kernel->swap_lock);
+	for(int k = 0; k < num_pages; k++){
+		int i = pfns[k];
+		struct PTE * page = pte_walk(mm, pages[k], 0);
+		uint32_t flags = PTE_PRESENT | (k == 0 ? PTE_REFERENCED : 0);
+
+		// Update SwapInfoStruct (map PFN to the swapped-in page). The reference of the PTE to the swap file page
+		// becomes the one of the page. The page is writable unless other PTEs still use the swap file page.
+		int slot = pte_pfn(page);
+		mm->stats.resident_pages++;
+		if(slot != -1){
+			mm->stats.swap_slots--;
+			mm->stats.swap_ins++;
+			kernel->si->swapper_space[i] = slot;
+			if(kernel->si->swap_cache[slot] == -1)
+				kernel->si->swap_cache[slot] = i;
+		}
+		if(slot == -1 || kernel->si->swap_count[slot] == 1)
+			flags |= PTE_WRITABLE;
+
+		pte_set(page, i, flags);
+		kernel->lru_entries[i].pid = pid;
+		kernel->lru_entries[i].virtual_page_id = pages[k];
+		kernel->page_mapcount[i] = 1;
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+
+	// Append the entries of these page frames to the tail of the LRU. Pages read ahead were not accessed yet.
+	for(int k = 0; k < num_pages; k++){
+		kernel->policy->insert(kernel, &kernel->lru_entries[pfns[k]], k == 0 ? hint : -1);
+		charge_add(kernel, &kernel->lru_entries[pfns[k]], 1);
+	}
+	pthread_mutex_unlock(&kernel->lru_lock);
+	free(pfns);
+	free(pages);
+	tlb_insert(mm, virtual_page_id, pte);
+	return pte;
+}
+
+// Start an access to a process (which may fault pages in), once no checkpoint runs, and end it. See checkpoint_lock.
+static void access_begin(struct Kernel * kernel){
+	pthread_mutex_lock(&kernel->checkpoint_lock);
+	while(kernel->checkpointing)
+		pthread_cond_wait(&kernel->checkpoint_wait, &kernel->checkpoint_lock);
+	kernel->running_accesses++;
+	pthread_mutex_unlock(&kernel->checkpoint_lock);
+}
+
+static void access_end(struct Kernel * kernel){
+	pthread_mutex_lock(&kernel->checkpoint_lock);
+	if(--kernel->running_accesses == 0 && kernel->checkpointing)
+		pthread_cond_broadcast(&kernel->checkpoint_wait);
+	pthread_mutex_unlock(&kernel->checkpoint_lock);
+}
+
+void lru_add(struct Kernel * kernel, int pid, long virtual_page_id){
+	access_begin(kernel);
+	pthread_mutex_lock(&kernel->mm[pid].lock);
+	if(kernel->running[pid] == 1)
+		map_page(kernel, pid, virtual_page_id, NULL, 0);
+	pthread_mutex_unlock(&kernel->mm[pid].lock);
+	access_end(kernel);
+}
+
+int lru_reclaim(struct Kernel * kernel, int num_pages){
+	return reclaim(kernel, num_pages, -1, -1, 0);
+}
+
+void lru_del(struct Kernel * kernel){
+	reclaim(kernel, 1, -1, -1, 0);
+}
+
+// Set up the MMStruct of a free slot for a process (or a shared region) of size bytes. The caller holds its lock.
+// The page table starts empty, with enough levels to cover every page of the process.
+static void mm_init(struct Kernel * kernel, int pid, long size){
+	struct MMStruct * mm = &kernel->mm[pid];
+	kernel->running[pid] = 1;
+	mm->size = size;
+	mm->page_table = NULL;
+	mm->levels = 1;
+	while(mm->levels * PAGE_TABLE_BITS < 63 && (num_virtual_pages(mm) - 1) >> (mm->levels * PAGE_TABLE_BITS) > 0)
+		mm->levels++;
+
+	mm->last_swap_in = -2;
+	mm->readahead_window = 0;
+	mm->num_pending_hits = 0;
+	tlb_flush(mm);
+	mm->tlb_hits = 0;
+	mm->tlb_misses = 0;
+	memset(&mm->stats, 0, sizeof(struct PagingStats));
+	mm->shared = NULL;
+	mm->via = -1;
+	mm->num_spans = 0;
+	mm->huge = 0;
+	mm->quota = 0;
+	mm->charged = 0;
+	mm->local.num_entries = 0;
+	mm->local.head = NULL;
+	mm->local.tail = NULL;
 }
 
 /*
         1. Check if there's a not-occupied process slot.
-        2. Alloc space for page_table (the size of it depends on how many pages you need).
-        3. The mapping to kernel-managed memory is not built, present bit and dirty bit are set to 0, PFN is set to -1.
+        2. Set up an empty page_table (the number of levels depends on how many pages you need).
+        3. The mapping to kernel-managed memory is not built, the tables of page_table are allocated when pages are first accessed.
         Return a pid (the index in MMStruct array) which is >= 0 when success, -1 when failure.
 */
-int proc_create_vm(struct Kernel * kernel, int size){
+int proc_create_vm(struct Kernel * kernel, long size){
+	return proc_create_vm_flags(kernel, size, 0);
+}
+
+int proc_create_vm_flags(struct Kernel * kernel, long size, int flags){
 	if(size > VIRTUAL_SPACE_SIZE) //check if the process larger than limit
 	{
 		return -1;
 	}
 
-	int page_need;
-	page_need = size / PAGE_SIZE;
-	if((size - (PAGE_SIZE * page_need))!=0)
-	{
-		page_need ++;
-	}
-	
 	int i;
 	for(i = 0; i < MAX_PROCESS_NUM; i++){
+		pthread_mutex_lock(&kernel->mm[i].lock);
 		if(kernel->running[i] == 0) //check if a free process slot exists
 		{
 			//exists
-			kernel->running[i] = 1; //update running
+			mm_init(kernel, i, size);
+			kernel->mm[i].huge = (flags & VM_HUGE_PAGES) != 0;
+			pthread_mutex_unlock(&kernel->mm[i].lock);
+			return i; //return pid
+		}
+		pthread_mutex_unlock(&kernel->mm[i].lock);
+	}
+	return -1;
+}
 
-			//allocate spaces for page table
+int proc_set_quota(struct Kernel * kernel, int pid, long num_pages){
+	if(pid < 0 || pid >= MAX_PROCESS_NUM || num_pages < 0)
+		return -1;
+	struct MMStruct * mm = &kernel->mm[pid];
+	pthread_mutex_lock(&mm->lock);
+	if(kernel->running[pid] == 0){
+		pthread_mutex_unlock(&mm->lock);
+		return -1;
+	}
+	mm->quota = num_pages;
+	charge_reserve(kernel, pid, 0);
+	pthread_mutex_unlock(&mm->lock);
+	return 0;
+}
+
+// The argument of pte_for_each over the page table of a process: the child of proc_fork_vm, or the exiting process
+// of proc_exit_vm and the pages of kernel-managed memory it releases.
+struct ProcPages {
+	struct Kernel * kernel;
+	int pid;
+	int * pfns;
+	int num_pages;
+};
+
+// Split a huge page visited by pte_for_each over process pid (see split_huge_page). The caller holds lru_lock.
+static void split_page(long virtual_page_id, struct PTE * pte, void * arg){
+	struct ProcPages * proc = (struct ProcPages *)arg;
+	if(pte_bits(pte) & PTE_HUGE)
+		split_huge_page(proc->kernel, proc->pid, virtual_page_id);
+}
 
-			kernel->mm[i].page_table = (struct PTE*)malloc(sizeof(struct PTE)* (page_need));
-			kernel->mm[i].size = size;
+// Share a page or swap file page of the parent with the child. The caller holds lru_lock and swap_lock.
+static void fork_page(long virtual_page_id, struct PTE * pte, void * arg){
+	struct ProcPages * child = (struct ProcPages *)arg;
+	struct Kernel * kernel = child->kernel;
+	uint32_t bits = pte_bits(pte);
+	int pfn = pte_pfn(pte);
+	if(pfn == -1)
+		return;
+	struct PTE * child_pte = pte_walk(&kernel->mm[child->pid], virtual_page_id, 1);
+	if(bits & PTE_PRESENT){
+		pte_clear_flags(pte, PTE_WRITABLE);
+		rmap_add(kernel, pfn, child->pid, virtual_page_id);
+		pte_set(child_pte, pfn, PTE_PRESENT | (bits & PTE_DIRTY));
+		kernel->mm[child->pid].stats.resident_pages++;
+	}
+	else {
+		kernel->si->swap_count[pfn]++;
+		pte_set(child_pte, pfn, 0);
+		kernel->mm[child->pid].stats.swap_slots++;
+	}
+}
 
-			//memset all  PFN to be -1 and present byte to 0
-			for(int j=0; j<page_need;j++)
-			{
-				kernel->mm[i].page_table[j].PFN = -1;
-				kernel->mm[i].page_table[j].present = 0;
-				kernel->mm[i].page_table[j].dirty = 0;
+// Drop the reference of a PTE of an exiting process to its page or swap file page. A page nobody else maps
+// leaves the LRU and is released with its swap file page. The caller holds lru_lock and swap_lock.
+static void release_page(long virtual_page_id, struct PTE * pte, void * arg){
+	struct ProcPages * exit_pages = (struct ProcPages *)arg;
+	struct Kernel * kernel = exit_pages->kernel;
+	struct MMStruct * mm = &kernel->mm[exit_pages->pid];
+	int pfn = pte_pfn(pte);
+	int num_pages = (pte_bits(pte) & PTE_HUGE) ? HUGE_PAGE_PAGES : 1;
+	if(pte_present(pte)){
+		struct LRUEntry * entry = &kernel->lru_entries[pfn];
+		mm->stats.resident_pages -= num_pages;
+		if(rmap_del(kernel, pfn, exit_pages->pid, virtual_page_id) == 0){
+			lru_unlink(lru_queue(kernel, entry->queue), entry);
+			charge_del(kernel, entry, num_pages);
+			for(int i = 0; i < num_pages; i++){
+				swap_detach(kernel, pfn + i);
+				exit_pages->pfns[exit_pages->num_pages++] = pfn + i;
 			}
-			return i; //return pid
 		}
 	}
-	return -1;
+	else if(pfn != -1){
+		mm->stats.swap_slots -= num_pages;
+		swap_put_pages(kernel, pfn, num_pages);
+	}
+}
+
+// Release a page like release_page, for a process that keeps running: the PTE is not mapped any more.
+static void discard_page(long virtual_page_id, struct PTE * pte, void * arg){
+	release_page(virtual_page_id, pte, arg);
+	pte_set(pte, -1, 0);
+}
+
+// Release the PTEs of a table of an exiting process (see release_page) and free the table with the tables below it,
+// in one pass. The statistics of the process count its pages and swap file pages, so once they are all released
+// the PTEs left are not looked at, and the tables are only freed. The caller holds lru_lock and swap_lock.
+static void release_table(struct ProcPages * exit_pages, void * table, int level, long base){
+	struct MMStruct * mm = &exit_pages->kernel->mm[exit_pages->pid];
+	if(table == NULL)
+		return;
+	if(level == 0 && table_is_huge(table)){
+		release_page(base, huge_pte(table), exit_pages);
+		free(huge_pte(table));
+		return;
+	}
+	long span = 1L << (level * PAGE_TABLE_BITS);
+	for(int i = 0; i < PAGE_TABLE_ENTRIES; i++){
+		if(level > 0)
+			release_table(exit_pages, ((void **)table)[i], level - 1, base + i * span);
+		else if(mm->stats.resident_pages > 0 || mm->stats.swap_slots > 0)
+			release_page(base + i, &((struct PTE *)table)[i], exit_pages);
+		else
+			break;
+	}
+	free(table);
+}
+
+// Release the pages, swap file pages and page table of a process (or a shared region). The caller holds its lock.
+// The cost follows the pages of the process and its tables: the pages it releases (at most its resident pages)
+// are freed at once (free_frames), and so are the swap file pages of a huge page.
+static void mm_release(struct Kernel * kernel, int pid){
+	struct MMStruct * mm = &kernel->mm[pid];
+	mm->num_pending_hits = 0;
+	tlb_flush(mm);
+
+	struct ProcPages exit_pages = { kernel, pid, (int *)malloc(sizeof(int) * max(1, mm->stats.resident_pages)), 0 };
+	pthread_mutex_lock(&kernel->lru_lock);
+	pthread_mutex_lock(&kernel->swap_lock);
+	release_table(&exit_pages, mm->page_table, mm->levels - 1, 0);
+	pthread_mutex_unlock(&kernel->swap_lock);
+	pthread_mutex_unlock(&kernel->lru_lock);
+	mm->page_table = NULL;
+	free_frames(kernel, exit_pages.pfns, exit_pages.num_pages);
+	free(exit_pages.pfns);
+	kernel->running[pid] = 0;
+}
+
+// Drop a mapping of a shared region, and remove the region with its last one. The caller holds shared_lock.
+// Nothing else maps the region then, so its slot is only held shortly by reclaim, and can be waited for.
+static void unmap_shared(struct Kernel * kernel, struct SharedMapping * mapping){
+	struct SharedRegion * region = &kernel->shared_regions[mapping->region];
+	if(--region->refs == 0){
+		int slot = MAX_PROCESS_NUM + mapping->region;
+		pthread_mutex_lock(&kernel->mm[slot].lock);
+		mm_release(kernel, slot);
+		pthread_mutex_unlock(&kernel->mm[slot].lock);
+		free(region->name);
+		region->name = NULL;
+	}
+	free(mapping);
+}
+
+int proc_fork_vm(struct Kernel * kernel, int pid){
+	if(pid < 0 || pid >= MAX_PROCESS_NUM)
+		return -1;
+	struct MMStruct * mm = &kernel->mm[pid];
+	pthread_mutex_lock(&mm->lock);
+	if(kernel->running[pid] == 0 || mm->num_spans > 0){
+		pthread_mutex_unlock(&mm->lock);
+		return -1;
+	}
+
+	// Holding the lock of the parent, the slots are locked with trylock, and a slot busy in another thread is skipped.
+	int child = -1;
+	for(int i = 0; i < MAX_PROCESS_NUM && child == -1; i++){
+		if(i == pid || pthread_mutex_trylock(&kernel->mm[i].lock) != 0)
+			continue;
+		if(kernel->running[i] == 0)
+			child = i;
+		else
+			pthread_mutex_unlock(&kernel->mm[i].lock);
+	}
+	if(child == -1){
+		pthread_mutex_unlock(&mm->lock);
+		return -1;
+	}
+
+	struct MMStruct * child_mm = &kernel->mm[child];
+	mm_init(kernel, child, mm->size);
+
+	// Pages are shared copy-on-write one by one, so the huge pages of the parent are split first.
+	// The child maps its own new blocks with huge pages too.
+	struct ProcPages parent = { kernel, pid, NULL, 0 };
+	struct ProcPages arg = { kernel, child, NULL, 0 };
+	pthread_mutex_lock(&kernel->lru_lock);
+	pthread_mutex_lock(&kernel->swap_lock);
+	if(mm->huge)
+		pte_for_each(mm, split_page, &parent);
+	pte_for_each(mm, fork_page, &arg);
+	pthread_mutex_unlock(&kernel->swap_lock);
+	pthread_mutex_unlock(&kernel->lru_lock);
+	child_mm->huge = mm->huge;
+	child_mm->quota = mm->quota;
+
+	// The child maps the shared regions of the parent too.
+	pthread_mutex_lock(&kernel->shared_lock);
+	for(struct SharedMapping * mapping = mm->shared; mapping != NULL; mapping = mapping->next){
+		struct SharedMapping * copy = (struct SharedMapping *)malloc(sizeof(struct SharedMapping));
+		*copy = *mapping;
+		copy->next = child_mm->shared;
+		child_mm->shared = copy;
+		kernel->shared_regions[mapping->region].refs++;
+	}
+	pthread_mutex_unlock(&kernel->shared_lock);
+
+	pthread_mutex_unlock(&child_mm->lock);
+	pthread_mutex_unlock(&mm->lock);
+	return child;
+}
+
+int vm_map_shared(struct Kernel * kernel, int pid, const char * name, char * addr, long size){
+	if(pid < 0 || pid >= MAX_PROCESS_NUM || name == NULL || size <= 0 || (uintptr_t)(addr) % PAGE_SIZE != 0)
+		return -1;
+	struct MMStruct * mm = &kernel->mm[pid];
+	long start = (long)((uintptr_t)(addr) / PAGE_SIZE);
+	long num_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	pthread_mutex_lock(&mm->lock);
+	int valid = kernel->running[pid] == 1 && mm->num_spans == 0 && (uintptr_t)(addr) < (uintptr_t)(mm->size) && size <= mm->size - (long)(uintptr_t)(addr);
+	for(struct SharedMapping * mapping = mm->shared; valid && mapping != NULL; mapping = mapping->next){
+		if(start < mapping->start + mapping->num_pages && mapping->start < start + num_pages)
+			valid = 0;
+	}
+	if(!valid){
+		pthread_mutex_unlock(&mm->lock);
+		return -1;
+	}
+
+	// Find the region, or create it in a free slot.
+	pthread_mutex_lock(&kernel->shared_lock);
+	int region = -1;
+	int free_region = -1;
+	for(int i = 0; i < MAX_SHARED_REGIONS && region == -1; i++){
+		if(kernel->shared_regions[i].name == NULL){
+			if(free_region == -1)
+				free_region = i;
+		}
+		else if(strcmp(kernel->shared_regions[i].name, name) == 0)
+			region = i;
+	}
+	if(region == -1 && free_region != -1){
+		region = free_region;
+		struct MMStruct * region_mm = &kernel->mm[MAX_PROCESS_NUM + region];
+		pthread_mutex_lock(&region_mm->lock);
+		mm_init(kernel, MAX_PROCESS_NUM + region, size);
+		pthread_mutex_unlock(&region_mm->lock);
+		kernel->shared_regions[region].name = strdup(name);
+	}
+	else if(region != -1 && kernel->mm[MAX_PROCESS_NUM + region].size < size)
+		region = -1;
+	if(region == -1){
+		pthread_mutex_unlock(&kernel->shared_lock);
+		pthread_mutex_unlock(&mm->lock);
+		return -1;
+	}
+	kernel->shared_regions[region].refs++;
+	pthread_mutex_unlock(&kernel->shared_lock);
+
+	// The pages of the process in the range are released, the range reads as zero again once unmapped.
+	// The huge pages overlapping it are split first, so only the pages in the range go.
+	struct ProcPages discarded = { kernel, pid, (int *)malloc(sizeof(int) * KERNEL_SPACE_SIZE / PAGE_SIZE), 0 };
+	pthread_mutex_lock(&kernel->lru_lock);
+	pthread_mutex_lock(&kernel->swap_lock);
+	if(mm->huge)
+		pte_for_each_range(mm, start, start + num_pages, split_page, &discarded);
+	pte_for_each_range(mm, start, start + num_pages, discard_page, &discarded);
+	pthread_mutex_unlock(&kernel->swap_lock);
+	pthread_mutex_unlock(&kernel->lru_lock);
+	free_frames(kernel, discarded.pfns, discarded.num_pages);
+	free(discarded.pfns);
+
+	struct SharedMapping * mapping = (struct SharedMapping *)malloc(sizeof(struct SharedMapping));
+	mapping->start = start;
+	mapping->num_pages = num_pages;
+	mapping->region = region;
+	mapping->next = mm->shared;
+	mm->shared = mapping;
+	pthread_mutex_unlock(&mm->lock);
+	return 0;
+}
+
+int vm_unmap_shared(struct Kernel * kernel, int pid, char * addr){
+	if(pid < 0 || pid >= MAX_PROCESS_NUM)
+		return -1;
+	struct MMStruct * mm = &kernel->mm[pid];
+	pthread_mutex_lock(&mm->lock);
+	struct SharedMapping ** link = &mm->shared;
+	while(*link != NULL && (*link)->start * PAGE_SIZE != (long)(uintptr_t)(addr))
+		link = &(*link)->next;
+	if(kernel->running[pid] == 0 || mm->num_spans > 0 || *link == NULL){
+		pthread_mutex_unlock(&mm->lock);
+		return -1;
+	}
+	struct SharedMapping * mapping = *link;
+	*link = mapping->next;
+	pthread_mutex_lock(&kernel->shared_lock);
+	unmap_shared(kernel, mapping);
+	pthread_mutex_unlock(&kernel->shared_lock);
+	pthread_mutex_unlock(&mm->lock);
+	return 0;
+}
+
+// Find where the page a process accesses at *virtual_page_id is: in the slot of a shared region mapped there,
+// or in the process itself. For a shared region, lock its slot and make *virtual_page_id the page of the region.
+// The caller holds the lock of process pid, and calls unlock_shared_page once done with the page.
+// Other processes mapping the region may hold its slot while they fault, and reclaim may need the pages of this one,
+// so the lock of the process is dropped while waiting.
+static int lock_shared_page(struct Kernel * kernel, int pid, long * virtual_page_id){
+	struct SharedMapping * mapping = kernel->mm[pid].shared;
+	while(mapping != NULL){
+		if(*virtual_page_id < mapping->start || *virtual_page_id >= mapping->start + mapping->num_pages){
+			mapping = mapping->next;
+			continue;
+		}
+		int slot = MAX_PROCESS_NUM + mapping->region;
+		if(pthread_mutex_trylock(&kernel->mm[slot].lock) != 0){
+			pthread_mutex_unlock(&kernel->mm[pid].lock);
+			sched_yield();
+			pthread_mutex_lock(&kernel->mm[pid].lock);
+			mapping = kernel->mm[pid].shared;
+			continue;
+		}
+		kernel->mm[slot].via = pid;
+		*virtual_page_id -= mapping->start;
+		return slot;
+	}
+	return pid;
+}
+
+static void unlock_shared_page(struct Kernel * kernel, int pid, int slot){
+	if(slot != pid){
+		kernel->mm[slot].via = -1;
+		pthread_mutex_unlock(&kernel->mm[slot].lock);
+	}
+}
+
+/*
+        Make a present page of process pid writable before the process writes it (copy-on-write).
+        1. A page mapped by other PTEs is copied to a new page of kernel-managed memory, private to the process.
+        2. A page mapped only by the process becomes writable. If other PTEs hold its swap file page, the page forgets it,
+           since the content there is theirs.
+        Return 1 when success, 0 when the page was evicted to make room for the copy (map it again and retry).
+*/
+static int cow_page(struct Kernel * kernel, int pid, long virtual_page_id, struct PTE * pte){
+	int new_pfn = -1;
+	pthread_mutex_lock(&kernel->lru_lock);
+	if(kernel->page_mapcount[pte_pfn(pte)] > 1){
+		pthread_mutex_unlock(&kernel->lru_lock);
+		charge_reserve(kernel, pid, 1);
+		alloc_pages(kernel, &new_pfn, 1, -1, pid);
+		pthread_mutex_lock(&kernel->lru_lock);
+		if(!pte_present(pte)){
+			pthread_mutex_unlock(&kernel->lru_lock);
+			free_frames(kernel, &new_pfn, 1);
+			return 0;
+		}
+	}
+
+	int pfn = pte_pfn(pte);
+	if(kernel->page_mapcount[pfn] > 1){
+		// Nobody writes a shared page, so it can be copied.
+		memcpy(kernel->space + PAGE_SIZE * new_pfn, kernel->space + PAGE_SIZE * pfn, PAGE_SIZE);
+		rmap_del(kernel, pfn, pid, virtual_page_id);
+		kernel->si->swapper_space[new_pfn] = -1;
+		kernel->lru_entries[new_pfn].pid = pid;
+		kernel->lru_entries[new_pfn].virtual_page_id = virtual_page_id;
+		kernel->page_mapcount[new_pfn] = 1;
+		pte_set(pte, new_pfn, PTE_PRESENT | PTE_REFERENCED | PTE_WRITABLE);
+		kernel->policy->insert(kernel, &kernel->lru_entries[new_pfn], -1);
+		charge_add(kernel, &kernel->lru_entries[new_pfn], 1);
+		pthread_mutex_unlock(&kernel->lru_lock);
+		return 1;
+	}
+
+	pthread_mutex_lock(&kernel->swap_lock);
+	int swap_page_id = kernel->si->swapper_space[pfn];
+	if(swap_page_id != -1 && kernel->si->swap_count[swap_page_id] > 1)
+		swap_detach(kernel, pfn);
+	pthread_mutex_unlock(&kernel->swap_lock);
+	pte_set_flags(pte, PTE_WRITABLE);
+	pthread_mutex_unlock(&kernel->lru_lock);
+	if(new_pfn != -1)
+		free_frames(kernel, &new_pfn, 1);
+	return 1;
+}
+
+// Take the next piece of a vectored access, at most the rest of a page: *segment and *done are its position in
+// the segments (done bytes into iov[segment]), moved past the piece. Return its size and address, 0 at the end.
+static int next_piece(const struct iovec * iov, int iovcnt, int * segment, size_t * done, uintptr_t * addr){
+	while(*segment < iovcnt && *done == iov[*segment].iov_len){
+		(*segment)++;
+		*done = 0;
+	}
+	if(*segment == iovcnt)
+		return 0;
+	*addr = (uintptr_t)(iov[*segment].iov_base) + *done;
+	int n = (int)min(iov[*segment].iov_len - *done, (size_t)(PAGE_SIZE - *addr % PAGE_SIZE));
+	*done += n;
+	return n;
+}
+
+static void unlock_segments(struct Kernel * kernel, int pid){
+	pthread_mutex_unlock(&kernel->mm[pid].lock);
+	access_end(kernel);
+}
+
+// Start a vectored access to process pid (see access_begin), check its segments and lock the process.
+// Return the number of bytes, -1 when out of bounds. Once done with the process, call unlock_segments.
+static long lock_segments(struct Kernel * kernel, int pid, const struct iovec * iov, int iovcnt){
+	if(pid < 0 || pid >= MAX_PROCESS_NUM || iovcnt < 0)
+		return -1;
+	access_begin(kernel);
+	pthread_mutex_lock(&kernel->mm[pid].lock);
+	long size = 0;
+	for(int i = 0; i < iovcnt && kernel->running[pid] == 1; i++){
+		uintptr_t end = (uintptr_t)(kernel->mm[pid].size);
+		if(iov[i].iov_len > end || (uintptr_t)(iov[i].iov_base) > end - iov[i].iov_len){
+			unlock_segments(kernel, pid);
+			return -1;
+		}
+		size += iov[i].iov_len;
+	}
+	if(kernel->running[pid] == 0){
+		unlock_segments(kernel, pid);
+		return -1;
+	}
+	return size;
+}
+
+/*
+        Copy the segments [iov, iov+iovcnt) of the user space of process pid to buf, or from buf with write = 1.
+        The pages are accessed a window of up to window pages at a time, and a fault brings in the pages of the
+        rest of the window with it (see map_page). vm_read and vm_write use a window of one page.
+*/
+static int vm_copy(struct Kernel * kernel, int pid, const struct iovec * iov, int iovcnt, char * buf, int write, int window){
+	long size = lock_segments(kernel, pid, iov, iovcnt);
+	if(size == -1)
+		return -1;
+	stat_add(&kernel->stats.bytes_copied, size);
+	kernel->mm[pid].stats.bytes_copied += size;
+
+	// Copy page by page, since the range may be larger than the kernel-managed memory.
+	long * pages = (long *)malloc(sizeof(long) * window);
+	int segment = 0;
+	size_t done = 0;
+	int next_segment = 0;
+	size_t next_done = 0;
+	while(1){
+		// The virtual pages of the next pieces.
+		int num_pages = 0;
+		uintptr_t offset;
+		while(num_pages < window && next_piece(iov, iovcnt, &next_segment, &next_done, &offset) > 0)
+			pages[num_pages++] = offset / PAGE_SIZE;
+		if(num_pages == 0)
+			break;
+
+		for(int i = 0; i < num_pages; i++){
+			int n = next_piece(iov, iovcnt, &segment, &done, &offset);
+			long virtual_page_id = pages[i];
+			int slot = lock_shared_page(kernel, pid, &virtual_page_id);
+			struct PTE * pte = map_page(kernel, slot, virtual_page_id, pages + i + 1, num_pages - i - 1);
+			while(write && !(pte_bits(pte) & PTE_WRITABLE)){
+				if(!cow_page(kernel, slot, virtual_page_id, pte))
+					map_page(kernel, slot, virtual_page_id, NULL, 0);
+			}
+			char * page = page_address(kernel, pte, virtual_page_id) + offset % PAGE_SIZE;
+			if(write){
+				memcpy(page, buf, n);
+				pte_set_flags(pte, PTE_DIRTY);
+			}
+			else
+				memcpy(buf, page, n);
+			unlock_shared_page(kernel, pid, slot);
+			buf += n;
+		}
+	}
+	free(pages);
+	unlock_segments(kernel, pid);
+	return 0;
 }
 
 /*
@@ -380,58 +2664,10 @@ int proc_create_vm(struct Kernel * kernel, int size){
         Return 0 when success, -1 when failure (out of bounds).
 */
 int vm_read(struct Kernel * kernel, int pid, char * addr, int size, char * buf){
-	if(pid > MAX_PROCESS_NUM || kernel->running[pid] == 0 || (uintptr_t)(addr) + (uintptr_t)(size) > (uintptr_t)(kernel->mm[pid].size))
+	if(size < 0)
 		return -1;
-	
-	int fake_addr = (long)addr/PAGE_SIZE;
-	int final_pos = (size+(long)addr+1)/PAGE_SIZE;
-
-	//printf("fake_addr = %d\n", fake_addr);
-	//printf("final_pos = %d\n\n", final_pos);
-	for(int i = fake_addr; i < final_pos+1; i++)
-	{
-		//for i=fake_address to number of page_table
-		if(kernel->mm[pid].page_table[i].present == 0)
-		{
-			//map them until found the free kernel-managed memory pages
-			for(int j=0; j< (MAX_PROCESS_NUM*VIRTUAL_SPACE_SIZE/PAGE_SIZE);j++)
-			{
-				if(kernel->occupied_pages[j] == 0)
-				{
-					kernel->occupied_pages[j] = 1;  
-					kernel->mm[pid].page_table[i].PFN = j;  //set the page_table
-					break;
-				}
-				else if(kernel->occupied_pages[j] == 1)
-				{
-					for(int k=0;k < KERNEL_SPACE_SIZE / PAGE_SIZE;k++)
-					{
-						if(kernel->si->swapper_space[k]==-1)
-						{
-							kernel->si->swapper_space[k]==0;
-							kernel->si->swap_map[pid]=k;
-							lru_add(kernel, pid, j);
-							break;
-						}
-					}
-				}
-			}
-			kernel->mm[pid].page_table[i].present = 1;
-
-		}
-		else if(kernel->mm[pid].page_table[i].present == 1)
-		{
-			//swap in
-			lru_del(kernel);
-			kernel->si->swap_map[pid]=0;
-			kernel->mm[pid].page_table[i].present = 0;
-		}
-	}
-	//printf("size before = %d\n", size);
-	//size = (final_pos-fake_addr+1)*PAGE_SIZE;
-	//printf("size after = %d\n\n", size);
-	memcpy(buf, kernel->space + (uintptr_t)(addr), size); //don't know if correct
-	return 0;
+	struct iovec iov = { addr, (size_t)size };
+	return vm_copy(kernel, pid, &iov, 1, buf, 0, 1);
 }
 
 /*
@@ -442,76 +2678,910 @@ int vm_read(struct Kernel * kernel, int pid, char * addr, int size, char * buf){
         Return 0 when success, -1 when failure (out of bounds).
 */
 int vm_write(struct Kernel * kernel, int pid, char * addr, int size, char * buf){
-	if(pid > MAX_PROCESS_NUM || kernel->running[pid] == 0 || (uintptr_t)(addr) + (uintptr_t)(size) > (uintptr_t)(kernel->mm[pid].size))
+	if(size < 0)
 		return -1;
+	struct iovec iov = { addr, (size_t)size };
+	return vm_copy(kernel, pid, &iov, 1, buf, 1, 1);
+}
 
+// The number of pages a vectored access looks ahead at, and may fault in with a fault (see batch_pages).
+static int batch_window(void){
+	return max(1, KERNEL_SPACE_SIZE / PAGE_SIZE / 4);
+}
 
-	int fake_addr = (long)(addr)/PAGE_SIZE;
-	int final_pos = (size+(long)addr+1)/PAGE_SIZE;
+int vm_readv(struct Kernel * kernel, int pid, const struct iovec * iov, int iovcnt, char * buf){
+	return vm_copy(kernel, pid, iov, iovcnt, buf, 0, batch_window());
+}
 
-	//printf("fake_addr = %d\n", fake_addr);
-	//printf("final_pos = %d\n\n", final_pos);
-	for(int i = fake_addr; i < final_pos; i++)
-	{
-		//for i=fake_address to number of page_table
-		if(kernel->mm[pid].page_table[i].present == 0)
-		{
-			//map them until found the free kernel-managed memory pages
-			for(int j=0; j< (MAX_PROCESS_NUM*VIRTUAL_SPACE_SIZE/PAGE_SIZE);j++)
-			{
-				if(kernel->occupied_pages[j] == 0)
-				{
-					kernel->occupied_pages[j] = 1;  
-					kernel->mm[pid].page_table[i].PFN = j;  //set the page_table
-					break;
-				}
-				else if(kernel->occupied_pages[j] == 1)
-				{
-					for(int k=0;k < KERNEL_SPACE_SIZE / PAGE_SIZE;k++)
-					{
-						if(kernel->si->swapper_space[k]==-1)
-						{
-							kernel->si->swapper_space[k]==0;
-							kernel->si->swap_map[pid]=k;
-							lru_add(kernel, pid, j);
-							break;
-						}
-					}
-				}
-			}
-			kernel->mm[pid].page_table[i].present = 1;
+int vm_writev(struct Kernel * kernel, int pid, const struct iovec * iov, int iovcnt, char * buf){
+	return vm_copy(kernel, pid, iov, iovcnt, buf, 1, batch_window());
+}
+
+// Pin a page of kernel-managed memory for a span: it leaves the page replacement queues, so it is neither evicted
+// nor merged by ksm_scan, until it is unpinned. The caller holds lru_lock.
+static void pin_page(struct Kernel * kernel, int pfn){
+	struct LRUEntry * entry = &kernel->lru_entries[pfn];
+	if(kernel->page_pins[pfn]++ == 0){
+		lru_unlink(lru_queue(kernel, entry->queue), entry);
+		entry->queue = QUEUE_PINNED;
+	}
+}
+
+static void unpin_page(struct Kernel * kernel, int pfn){
+	if(--kernel->page_pins[pfn] == 0)
+		kernel->policy->insert(kernel, &kernel->lru_entries[pfn], -1);
+}
+
+int vm_map_span(struct Kernel * kernel, int pid, char * addr, int size, int write, struct VMSpan * span){
+	if(size < 0)
+		return -1;
+	struct iovec range = { addr, (size_t)size };
+	if(lock_segments(kernel, pid, &range, 1) == -1)
+		return -1;
+	int num_pages = size == 0 ? 0 : (int)(((uintptr_t)(addr) + size - 1) / PAGE_SIZE - (uintptr_t)(addr) / PAGE_SIZE + 1);
+	pthread_mutex_lock(&kernel->lru_lock);
+	int pinned = kernel->pinned_pages + num_pages <= KERNEL_SPACE_SIZE / PAGE_SIZE / 2;
+	if(pinned)
+		kernel->pinned_pages += num_pages;
+	pthread_mutex_unlock(&kernel->lru_lock);
+	if(!pinned){
+		unlock_segments(kernel, pid);
+		return -1;
+	}
+
+	span->pid = pid;
+	span->num_pages = num_pages;
+	span->iov = (struct iovec *)malloc(sizeof(struct iovec) * max(1, num_pages));
+	span->pfns = (int *)malloc(sizeof(int) * max(1, num_pages));
+	long * pages = (long *)malloc(sizeof(long) * max(1, num_pages));
+	for(int i = 0; i < num_pages; i++)
+		pages[i] = (uintptr_t)(addr) / PAGE_SIZE + i;
+
+	// Map the pages like vm_copy, and pin each one before mapping the next, which may evict pages of the process.
+	// A pinned page is private to the process (copied first if it is shared copy-on-write), so nothing else maps it.
+	int segment = 0;
+	size_t done = 0;
+	for(int i = 0; i < num_pages; i++){
+		uintptr_t offset;
+		int n = next_piece(&range, 1, &segment, &done, &offset);
+		long virtual_page_id = pages[i];
+		int slot = lock_shared_page(kernel, pid, &virtual_page_id);
+		struct PTE * pte = map_page(kernel, slot, virtual_page_id, pages + i + 1, min(num_pages - i - 1, batch_window()));
+		while(!(pte_bits(pte) & PTE_WRITABLE)){
+			if(!cow_page(kernel, slot, virtual_page_id, pte))
+				map_page(kernel, slot, virtual_page_id, NULL, 0);
 		}
+		if(write)
+			pte_set_flags(pte, PTE_DIRTY);
+		pthread_mutex_lock(&kernel->lru_lock);
+		// Pages are pinned one by one, so a huge page is split.
+		if(pte_bits(pte) & PTE_HUGE){
+			split_huge_page(kernel, slot, virtual_page_id);
+			pte = pte_walk(&kernel->mm[slot], virtual_page_id, 0);
+		}
+		pin_page(kernel, pte_pfn(pte));
+		pthread_mutex_unlock(&kernel->lru_lock);
+		unlock_shared_page(kernel, pid, slot);
+		span->pfns[i] = pte_pfn(pte);
+		span->iov[i].iov_base = kernel->space + PAGE_SIZE * span->pfns[i] + offset % PAGE_SIZE;
+		span->iov[i].iov_len = n;
 	}
+	free(pages);
+	kernel->mm[pid].num_spans++;
+	unlock_segments(kernel, pid);
+	return 0;
+}
 
-	memcpy(kernel->space + (uintptr_t)(addr), buf, size);
-	return  0;
+void vm_unmap_span(struct Kernel * kernel, struct VMSpan * span){
+	pthread_mutex_lock(&kernel->mm[span->pid].lock);
+	pthread_mutex_lock(&kernel->lru_lock);
+	for(int i = 0; i < span->num_pages; i++)
+		unpin_page(kernel, span->pfns[i]);
+	kernel->pinned_pages -= span->num_pages;
+	pthread_mutex_unlock(&kernel->lru_lock);
+	kernel->mm[span->pid].num_spans--;
+	pthread_mutex_unlock(&kernel->mm[span->pid].lock);
+	free(span->iov);
+	free(span->pfns);
+	span->iov = NULL;
+	span->pfns = NULL;
+	span->num_pages = 0;
 }
 
 /*
-        1. Check if the pid is valid.
-        2. Iterate the LRU queue to delete those active pages of this process.
-        3. Iterate the page_table in MMStruct.
-                3.1. Update occupied_pages and swapper_space if present=1.
-                3.2. Update swap_map if present=0 and PFN!=-1.
+        1. Check if the pid is valid, and that the process has no spans mapped by vm_map_span.
+        2. Unmap the shared regions of the process.
+        3. Iterate the page_table in MMStruct (only the tables allocated, and only until the pages of the process are
+           all released), freeing each table after its PTEs:
+                3.1. Delete the page from the LRU queue, and update swapper_space, if present=1 and no other process
+                     maps the page. The pages are given back to the buddy allocator together, as the largest blocks.
+                3.2. Update swap_map if present=0 and PFN!=-1 and no other PTE holds the swap file page.
         Return 0 when success, -1 when failure.
 */
 int proc_exit_vm(struct Kernel * kernel, int pid){
-	if(pid > MAX_PROCESS_NUM || kernel->running[pid] == 0)
+	if(pid < 0 || pid >= MAX_PROCESS_NUM)
+		return -1;
+	struct MMStruct * mm = &kernel->mm[pid];
+	pthread_mutex_lock(&mm->lock);
+	if(kernel->running[pid] == 0 || mm->num_spans > 0){
+		pthread_mutex_unlock(&mm->lock);
 		return -1;
+	}
 
-	lru_del(kernel);
-	kernel->si->swap_map[kernel->si->swapper_space[pid]]=0;
-	for(int i=0; i<kernel->mm[pid].size/PAGE_SIZE;i++)
-	{
-		//check present = 1;
-		//take the PFN;
-		if(kernel->mm[pid].page_table[i].present==1)
-		{
-			kernel->occupied_pages[kernel->mm[pid].page_table[i].PFN]=0;
-			//update swapper_space
-			kernel->si->swapper_space[pid]=-1 ;
+	pthread_mutex_lock(&kernel->shared_lock);
+	while(mm->shared != NULL){
+		struct SharedMapping * mapping = mm->shared;
+		mm->shared = mapping->next;
+		unmap_shared(kernel, mapping);
+	}
+	pthread_mutex_unlock(&kernel->shared_lock);
+
+	mm_release(kernel, pid);
+	pthread_mutex_unlock(&mm->lock);
+	return 0;
+}
+
+// A resident page and the hash of its content, for ksm_scan.
+struct PageHash {
+	uint64_t hash;
+	int pfn;
+};
+
+static int compare_page_hash(const void * a, const void * b){
+	const struct PageHash * x = (const struct PageHash *)a;
+	const struct PageHash * y = (const struct PageHash *)b;
+	if(x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->pfn - y->pfn;
+}
+
+// Stop the PTEs mapping the page of an LRUEntry from writing it, so the next write copies it (cow_page).
+static void write_protect(struct Kernel * kernel, struct LRUEntry * entry){
+	pte_clear_flags(entry_pte(kernel, entry), PTE_WRITABLE);
+	for(struct RMap * rmap = entry->rmap; rmap != NULL; rmap = rmap->next)
+		pte_clear_flags(pte_walk(&kernel->mm[rmap->pid], rmap->virtual_page_id, 0), PTE_WRITABLE);
+}
+
+// Map the PTEs of page pfn to page target, which has the same content, and take pfn off the queues.
+// The caller holds the locks of the processes mapping both pages, lru_lock and swap_lock.
+// Like fork_page, the new PTEs copy the dirty bit of the target, since any of them may become the one in its LRUEntry.
+static void merge_page(struct Kernel * kernel, int target, int pfn){
+	struct LRUEntry * entry = &kernel->lru_entries[pfn];
+	uint32_t flags = PTE_PRESENT | (pte_bits(entry_pte(kernel, &kernel->lru_entries[target])) & PTE_DIRTY);
+	pte_set(entry_pte(kernel, entry), target, flags);
+	rmap_add(kernel, target, entry->pid, entry->virtual_page_id);
+	while(entry->rmap != NULL){
+		struct RMap * rmap = entry->rmap;
+		pte_set(pte_walk(&kernel->mm[rmap->pid], rmap->virtual_page_id, 0), target, flags);
+		rmap_add(kernel, target, rmap->pid, rmap->virtual_page_id);
+		entry->rmap = rmap->next;
+		free(rmap);
+	}
+	kernel->page_mapcount[pfn] = 0;
+	lru_unlink(lru_queue(kernel, entry->queue), entry);
+	charge_del(kernel, entry, 1);
+	swap_detach(kernel, pfn);
+}
+
+/*
+        Same-page merging over the resident pages not pinned (vm_map_span) nor huge, whose processes can be locked:
+        1. Hash the content of each page, and sort the pages by hash.
+        2. In each run of equal hashes, compare the content with the first page, and merge the identical ones into it.
+        The merged pages are write-protected, so they are copied again by the first write (see cow_page).
+*/
+int ksm_scan(struct Kernel * kernel){
+	char * locked = (char *)calloc(kernel->num_mm, sizeof(char));
+	struct PageHash * pages = (struct PageHash *)malloc(sizeof(struct PageHash) * KERNEL_SPACE_SIZE / PAGE_SIZE);
+	int * pfns = (int *)malloc(sizeof(int) * KERNEL_SPACE_SIZE / PAGE_SIZE);
+	int num_pages = 0;
+	int num_merged = 0;
+
+	pthread_mutex_lock(&kernel->lru_lock);
+	for(struct LRUEntry * entry = lru_walk_next(kernel, NULL); entry != NULL; entry = lru_walk_next(kernel, entry)){
+		if(!lock_mappers(kernel, locked, entry, -1) || entry_pages(kernel, entry) > 1)
+			continue;
+		int pfn = entry - kernel->lru_entries;
+		pages[num_pages].hash = hash_bytes(kernel->space + PAGE_SIZE * pfn, PAGE_SIZE);
+		pages[num_pages].pfn = pfn;
+		num_pages++;
+	}
+	qsort(pages, num_pages, sizeof(struct PageHash), compare_page_hash);
+
+	pthread_mutex_lock(&kernel->swap_lock);
+	for(int i = 0; i < num_pages; ){
+		int target = pages[i].pfn;
+		int j;
+		for(j = i + 1; j < num_pages && pages[j].hash == pages[i].hash; j++){
+			int pfn = pages[j].pfn;
+			if(memcmp(kernel->space + PAGE_SIZE * target, kernel->space + PAGE_SIZE * pfn, PAGE_SIZE) != 0)
+				continue;
+			write_protect(kernel, &kernel->lru_entries[target]);
+			merge_page(kernel, target, pfn);
+			pfns[num_merged++] = pfn;
+		}
+		i = j;
+	}
+	pthread_mutex_unlock(&kernel->swap_lock);
+	pthread_mutex_unlock(&kernel->lru_lock);
+
+	free_frames(kernel, pfns, num_merged);
+	unlock_owners(kernel, locked);
+	free(pfns);
+	free(pages);
+	free(locked);
+	return num_merged;
+}
+
+/*
+        Checkpoint file of kernel_checkpoint() and kernel_restore(), in the byte order of the machine:
+        1. struct CheckpointHeader, written last, so that a file cut short has no valid header.
+        2. The state, metadata_length bytes at metadata_offset: a stream of values (see checkpoint_put), in this order.
+                2.1. Each slot of mm: 0 when it is not running, else 1, size, huge, quota, the counters of stats, its shared
+                     mappings (count, then start, num_pages and region of each), and its PTEs holding a page or a swap
+                     file page (the distance from the previous one minus 1, PFN and flags; -1 ends them).
+                2.2. Each shared region: the length of its name (-1 when unused), the name and refs.
+                2.3. The runs of pages of kernel-managed memory in use (first page, number of pages; -1 ends them), then
+                     for each page in use its LRUEntry (pid, virtual_page_id), page_mapcount, swapper_space and rmap
+                     (count, then pid and virtual_page_id of each).
+                2.4. The queues from their head: lru_recent and lru (count, then PFNs), ghost_recent and ghost_frequent
+                     (count, then pid and virtual_page_id), target_recent, and the local list of each running slot.
+                2.5. The runs of swap file pages in use, then the swap_count of each one, and the swap_cache (swap file
+                     page, PFN; -1 ends it).
+                2.6. The counters of the kernel.
+        3. The content of the swap file pages in use, in order, swap_length bytes at swap_offset right after the state.
+           The checkpoint holds them so that it does not depend on the swap file, which the kernel goes on writing.
+        4. The image of kernel-managed memory at space_offset, aligned for mmap, with holes for the free pages.
+        Values are zigzag LEB128 varints, so the small numbers (and -1) that make up most of the state take one byte.
+*/
+#define CHECKPOINT_MAGIC     "PAGECKPT"
+#define CHECKPOINT_VERSION   3
+#define CHECKPOINT_ALIGN     65536 // A multiple of the page size of the machine.
+
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	int32_t page_size;
+	int64_t kernel_space_size;
+	int64_t virtual_space_size;
+	int64_t swap_space_size;
+	int32_t max_process_num;
+	int32_t max_shared_regions;
+	int32_t policy;
+	int32_t page_table_bits;
+	// Not part of the configuration, which is compared up to here.
+	uint64_t metadata_offset;
+	uint64_t metadata_length;
+	uint64_t metadata_hash;
+	uint64_t swap_offset;
+	uint64_t swap_length;
+	uint64_t swap_hash;
+	uint64_t space_offset;
+};
+
+// The header of a checkpoint of the configuration of the kernel (without the offsets), with a swap file of swap_size bytes.
+static void checkpoint_header(struct CheckpointHeader * header, long swap_size){
+	memset(header, 0, sizeof(struct CheckpointHeader));
+	memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+	header->version = CHECKPOINT_VERSION;
+	header->page_size = PAGE_SIZE;
+	header->kernel_space_size = KERNEL_SPACE_SIZE;
+	header->virtual_space_size = VIRTUAL_SPACE_SIZE;
+	header->swap_space_size = swap_size;
+	header->max_process_num = MAX_PROCESS_NUM;
+	header->max_shared_regions = MAX_SHARED_REGIONS;
+	header->policy = PAGE_REPLACEMENT_POLICY;
+	header->page_table_bits = PAGE_TABLE_BITS;
+}
+
+// A growing buffer the state is encoded in.
+struct CheckpointBuffer {
+	unsigned char * data;
+	size_t length;
+	size_t capacity;
+};
+
+static void checkpoint_put_bytes(struct CheckpointBuffer * buf, const void * data, size_t length){
+	if(buf->length + length > buf->capacity){
+		buf->capacity = max(2 * buf->capacity, buf->length + length);
+		buf->data = (unsigned char *)realloc(buf->data, buf->capacity);
+	}
+	memcpy(buf->data + buf->length, data, length);
+	buf->length += length;
+}
+
+// Append a value as a zigzag LEB128 varint: 7 bits a byte, low bits first, the sign in the lowest bit.
+static void checkpoint_put(struct CheckpointBuffer * buf, long value){
+	uint64_t v = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	unsigned char bytes[10];
+	int n = 0;
+	do {
+		bytes[n] = v & 127;
+		v >>= 7;
+		if(v != 0)
+			bytes[n] |= 128;
+		n++;
+	} while(v != 0);
+	checkpoint_put_bytes(buf, bytes, n);
+}
+
+static void checkpoint_put_stats(struct CheckpointBuffer * buf, const struct PagingStats * stats){
+	const long * counters = (const long *)stats;
+	for(size_t i = 0; i < sizeof(struct PagingStats) / sizeof(long); i++)
+		checkpoint_put(buf, counters[i]);
+}
+
+// The state being decoded. A value that is out of range, or past the end, sets error, and reads as the lowest
+// value allowed, so that decoding goes on safely to the end, where error is checked once.
+struct CheckpointReader {
+	const unsigned char * data;
+	size_t length;
+	size_t pos;
+	int error;
+};
+
+static long checkpoint_get(struct CheckpointReader * r, long low, long high){
+	uint64_t v = 0;
+	for(int shift = 0; ; shift += 7){
+		if(r->pos >= r->length || shift > 63){
+			r->error = 1;
+			return low;
 		}
+		unsigned char byte = r->data[r->pos++];
+		v |= (uint64_t)(byte & 127) << shift;
+		if(!(byte & 128))
+			break;
+	}
+	long value = (long)(v >> 1) ^ -(long)(v & 1);
+	if(value < low || value > high){
+		r->error = 1;
+		return low;
+	}
+	return value;
+}
+
+static void checkpoint_get_bytes(struct CheckpointReader * r, void * data, size_t length){
+	if(r->length - r->pos < length){
+		r->error = 1;
+		memset(data, 0, length);
+		return;
+	}
+	memcpy(data, r->data + r->pos, length);
+	r->pos += length;
+}
+
+static void checkpoint_get_stats(struct CheckpointReader * r, struct PagingStats * stats){
+	long * counters = (long *)stats;
+	for(size_t i = 0; i < sizeof(struct PagingStats) / sizeof(long); i++)
+		counters[i] = checkpoint_get(r, 0, LONG_MAX);
+}
+
+// The PTEs of a process being encoded, with the last virtual page written.
+struct CheckpointPTEs {
+	struct CheckpointBuffer * buf;
+	long last;
+};
+
+static void checkpoint_pte(long virtual_page_id, struct PTE * pte, void * arg){
+	struct CheckpointPTEs * ptes = (struct CheckpointPTEs *)arg;
+	if(pte_pfn(pte) == -1)
+		return;
+	checkpoint_put(ptes->buf, virtual_page_id - ptes->last - 1);
+	checkpoint_put(ptes->buf, pte_pfn(pte));
+	checkpoint_put(ptes->buf, pte_bits(pte) >> PTE_PFN_BITS);
+	ptes->last = virtual_page_id;
+}
+
+// Write length bytes at offset of a file. Return 0 when success, -1 when failure.
+static int checkpoint_write(int fd, const void * data, size_t length, off_t offset){
+	while(length > 0){
+		ssize_t n = pwrite(fd, data, length, offset);
+		if(n <= 0)
+			return -1;
+		data = (const char *)data + n;
+		length -= n;
+		offset += n;
 	}
-	free(kernel->mm[pid].page_table);
 	return 0;
 }
+
+// Write the content of the swap file pages in use at offset of a checkpoint (3. in the format above), and set hash to
+// its hash. Each run is read from the swap file at once, and the pages in the zswap pool are taken from it instead.
+// The caller holds every lock but frame_lock. Return the number of bytes written, -1 when failure.
+static long checkpoint_swap_pages(struct Kernel * kernel, int fd, off_t offset, uint64_t * hash){
+	int num_swap_pages = kernel->si->size / PAGE_SIZE;
+	struct Bitmap * swap_map = &kernel->si->swap_map;
+	int batch = min(IOV_MAX, 64);
+	char * pages = (char *)malloc((size_t)PAGE_SIZE * batch);
+	struct iovec * iov = (struct iovec *)malloc(sizeof(struct iovec) * batch);
+	int failed = 0;
+	long length = 0;
+	*hash = hash_bytes(NULL, 0);
+	for(int i = 0; !failed && i < num_swap_pages; ){
+		int n = 0;
+		while(n < batch && i + n < num_swap_pages && bitmap_test(swap_map, i + n)){
+			iov[n].iov_base = pages + (size_t)PAGE_SIZE * n;
+			iov[n].iov_len = PAGE_SIZE;
+			n++;
+		}
+		if(n == 0){
+			i++;
+			continue;
+		}
+		swap_file_read_pages(kernel, i, iov, n);
+		for(int k = 0; kernel->si->zswap != NULL && k < n; k++){
+			if(kernel->si->zswap[i + k] != NULL)
+				zswap_decompress(kernel->si->zswap[i + k], kernel->si->zswap_length[i + k], (unsigned char *)iov[k].iov_base);
+		}
+		*hash = hash_more(*hash, pages, (size_t)PAGE_SIZE * n);
+		failed = checkpoint_write(fd, pages, (size_t)PAGE_SIZE * n, offset + length) != 0;
+		length += (long)PAGE_SIZE * n;
+		i += n;
+	}
+	free(iov);
+	free(pages);
+	return failed ? -1 : length;
+}
+
+// Encode the state of the kernel (2. in the format above). The caller holds every lock but frame_lock.
+static void checkpoint_state(struct Kernel * kernel, struct CheckpointBuffer * buf){
+	int num_frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+	int num_swap_pages = kernel->si->size / PAGE_SIZE;
+
+	for(int i = 0; i < kernel->num_mm; i++){
+		struct MMStruct * mm = &kernel->mm[i];
+		checkpoint_put(buf, kernel->running[i]);
+		if(!kernel->running[i])
+			continue;
+		checkpoint_put(buf, mm->size);
+		checkpoint_put(buf, mm->huge);
+		checkpoint_put(buf, mm->quota);
+		checkpoint_put_stats(buf, &mm->stats);
+		int num_shared = 0;
+		for(struct SharedMapping * mapping = mm->shared; mapping != NULL; mapping = mapping->next)
+			num_shared++;
+		checkpoint_put(buf, num_shared);
+		for(struct SharedMapping * mapping = mm->shared; mapping != NULL; mapping = mapping->next){
+			checkpoint_put(buf, mapping->start);
+			checkpoint_put(buf, mapping->num_pages);
+			checkpoint_put(buf, mapping->region);
+		}
+		struct CheckpointPTEs ptes = { buf, -1 };
+		pte_for_each(mm, checkpoint_pte, &ptes);
+		checkpoint_put(buf, -1);
+	}
+
+	for(int i = 0; i < MAX_SHARED_REGIONS; i++){
+		struct SharedRegion * region = &kernel->shared_regions[i];
+		checkpoint_put(buf, region->name == NULL ? -1 : (long)strlen(region->name));
+		if(region->name == NULL)
+			continue;
+		checkpoint_put_bytes(buf, region->name, strlen(region->name));
+		checkpoint_put(buf, region->refs);
+	}
+
+	pthread_mutex_lock(&kernel->frame_lock);
+	for(int pfn = 0; pfn < num_frames; pfn++){
+		if(!bitmap_test(&kernel->occupied_pages, pfn) || (pfn > 0 && bitmap_test(&kernel->occupied_pages, pfn - 1)))
+			continue;
+		int n = 1;
+		while(pfn + n < num_frames && bitmap_test(&kernel->occupied_pages, pfn + n))
+			n++;
+		checkpoint_put(buf, pfn);
+		checkpoint_put(buf, n);
+	}
+	checkpoint_put(buf, -1);
+	for(int pfn = 0; pfn < num_frames; pfn++){
+		if(!bitmap_test(&kernel->occupied_pages, pfn))
+			continue;
+		struct LRUEntry * entry = &kernel->lru_entries[pfn];
+		checkpoint_put(buf, entry->pid);
+		checkpoint_put(buf, entry->virtual_page_id);
+		checkpoint_put(buf, kernel->page_mapcount[pfn]);
+		checkpoint_put(buf, kernel->si->swapper_space[pfn]);
+		int num_rmap = 0;
+		for(struct RMap * rmap = entry->rmap; rmap != NULL; rmap = rmap->next)
+			num_rmap++;
+		checkpoint_put(buf, num_rmap);
+		for(struct RMap * rmap = entry->rmap; rmap != NULL; rmap = rmap->next){
+			checkpoint_put(buf, rmap->pid);
+			checkpoint_put(buf, rmap->virtual_page_id);
+		}
+	}
+	pthread_mutex_unlock(&kernel->frame_lock);
+
+	struct LRU * queues[] = { &kernel->lru_recent, &kernel->lru, &kernel->ghost_recent, &kernel->ghost_frequent };
+	for(int q = 0; q < 4; q++){
+		checkpoint_put(buf, queues[q]->num_entries);
+		for(struct LRUEntry * entry = queues[q]->head; entry != NULL; entry = entry->next){
+			if(q < 2)
+				checkpoint_put(buf, entry - kernel->lru_entries);
+			else {
+				checkpoint_put(buf, entry->pid);
+				checkpoint_put(buf, entry->virtual_page_id);
+			}
+		}
+	}
+	checkpoint_put(buf, kernel->target_recent);
+	for(int i = 0; i < kernel->num_mm; i++){
+		if(!kernel->running[i])
+			continue;
+		checkpoint_put(buf, kernel->mm[i].local.num_entries);
+		for(struct LRUEntry * entry = kernel->mm[i].local.head; entry != NULL; entry = entry->local_next)
+			checkpoint_put(buf, entry - kernel->lru_entries);
+	}
+
+	struct Bitmap * swap_map = &kernel->si->swap_map;
+	for(int i = 0; i < num_swap_pages; i++){
+		if(bitmap_test(swap_map, i) && (i == 0 || !bitmap_test(swap_map, i - 1))){
+			int n = 1;
+			while(i + n < num_swap_pages && bitmap_test(swap_map, i + n))
+				n++;
+			checkpoint_put(buf, i);
+			checkpoint_put(buf, n);
+		}
+	}
+	checkpoint_put(buf, -1);
+	for(int i = 0; i < num_swap_pages; i++){
+		if(bitmap_test(swap_map, i))
+			checkpoint_put(buf, kernel->si->swap_count[i]);
+	}
+	for(int i = 0; i < num_swap_pages; i++){
+		if(kernel->si->swap_cache[i] == -1)
+			continue;
+		checkpoint_put(buf, i);
+		checkpoint_put(buf, kernel->si->swap_cache[i]);
+	}
+	checkpoint_put(buf, -1);
+
+	checkpoint_put_stats(buf, &kernel->stats);
+}
+
+// Lock every slot of mm, in order, once the accesses running are done, holding new ones back until unlock_all_mm.
+// An access may wait for reclaim to evict the pages of another process while it holds its own, and reclaim only tries
+// the locks of other processes: it would wait forever for one locked here. Other threads hold a slot for a short time.
+static void lock_all_mm(struct Kernel * kernel){
+	pthread_mutex_lock(&kernel->checkpoint_lock);
+	while(kernel->checkpointing)
+		pthread_cond_wait(&kernel->checkpoint_wait, &kernel->checkpoint_lock);
+	kernel->checkpointing = 1;
+	while(kernel->running_accesses > 0)
+		pthread_cond_wait(&kernel->checkpoint_wait, &kernel->checkpoint_lock);
+	pthread_mutex_unlock(&kernel->checkpoint_lock);
+	for(int i = 0; i < kernel->num_mm; i++)
+		pthread_mutex_lock(&kernel->mm[i].lock);
+}
+
+static void unlock_all_mm(struct Kernel * kernel){
+	for(int i = 0; i < kernel->num_mm; i++)
+		pthread_mutex_unlock(&kernel->mm[i].lock);
+	pthread_mutex_lock(&kernel->checkpoint_lock);
+	kernel->checkpointing = 0;
+	pthread_cond_broadcast(&kernel->checkpoint_wait);
+	pthread_mutex_unlock(&kernel->checkpoint_lock);
+}
+
+int kernel_checkpoint(struct Kernel * kernel, const char * path){
+	// The state does not change while every process is locked: faults, evictions (whose victims stay locked
+	// until they are freed) and exits all hold the lock of a process. The pending hits are applied, so the queues are exact.
+	lock_all_mm(kernel);
+	pthread_mutex_lock(&kernel->lru_lock);
+	pthread_mutex_lock(&kernel->swap_lock);
+	// The checkpoint is written next to path and renamed over it once complete, so that a failure leaves the previous
+	// one, and so does a kernel restored from path, which maps it.
+	int ret = -1;
+	int fd = -1;
+	char * tmp_path = (char *)malloc(strlen(path) + 5);
+	sprintf(tmp_path, "%s.tmp", path);
+	if(kernel->pinned_pages > 0)
+		goto out;
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1)
+		goto out;
+	for(int i = 0; i < kernel->num_mm; i++){
+		if(kernel->running[i] && kernel->policy->hit != NULL)
+			apply_hits(kernel, i);
+	}
+
+	struct CheckpointBuffer buf = { NULL, 0, 0 };
+	checkpoint_state(kernel, &buf);
+	struct CheckpointHeader header;
+	checkpoint_header(&header, kernel->si->size);
+	header.metadata_offset = sizeof(struct CheckpointHeader);
+	header.metadata_length = buf.length;
+	header.metadata_hash = hash_bytes(buf.data, buf.length);
+	header.swap_offset = header.metadata_offset + buf.length;
+	int failed = checkpoint_write(fd, buf.data, buf.length, header.metadata_offset) != 0;
+	free(buf.data);
+	long swap_length = failed ? -1 : checkpoint_swap_pages(kernel, fd, header.swap_offset, &header.swap_hash);
+	failed = swap_length == -1;
+	header.swap_length = failed ? 0 : swap_length;
+	header.space_offset = (header.swap_offset + header.swap_length + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+
+	// Only the pages in use are written, the free ones are left as holes.
+	pthread_mutex_lock(&kernel->frame_lock);
+	for(int pfn = 0; !failed && pfn < KERNEL_SPACE_SIZE / PAGE_SIZE; ){
+		int n = 0;
+		while(pfn + n < KERNEL_SPACE_SIZE / PAGE_SIZE && bitmap_test(&kernel->occupied_pages, pfn + n))
+			n++;
+		if(n > 0)
+			failed = checkpoint_write(fd, kernel->space + (size_t)PAGE_SIZE * pfn, (size_t)PAGE_SIZE * n, header.space_offset + (off_t)PAGE_SIZE * pfn) != 0;
+		pfn += max(n, 1);
+	}
+	pthread_mutex_unlock(&kernel->frame_lock);
+	if(!failed && ftruncate(fd, header.space_offset + KERNEL_SPACE_SIZE) == 0 && fsync(fd) == 0
+	   && checkpoint_write(fd, &header, sizeof(header), 0) == 0 && fsync(fd) == 0 && rename(tmp_path, path) == 0)
+		ret = 0;
+out:
+	if(fd != -1)
+		close(fd);
+	if(fd != -1 && ret != 0)
+		unlink(tmp_path);
+	free(tmp_path);
+	pthread_mutex_unlock(&kernel->swap_lock);
+	pthread_mutex_unlock(&kernel->lru_lock);
+	unlock_all_mm(kernel);
+	return ret;
+}
+
+// Decode the state of a checkpoint into a kernel just created by init_kernel(). Every index is checked before it is
+// used, and so are the links between the parts that later code follows (a PTE and the page it maps, the queues).
+static void restore_state(struct Kernel * kernel, struct CheckpointReader * r){
+	int num_frames = KERNEL_SPACE_SIZE / PAGE_SIZE;
+	int num_swap_pages = kernel->si->size / PAGE_SIZE;
+	// 1 for a page in use, 2 once on a queue, 3 once on a local list.
+	char * used = (char *)calloc(num_frames, sizeof(char));
+
+	for(int i = 0; i < kernel->num_mm && !r->error; i++){
+		struct MMStruct * mm = &kernel->mm[i];
+		if(!checkpoint_get(r, 0, 1))
+			continue;
+		mm_init(kernel, i, checkpoint_get(r, 1, VIRTUAL_SPACE_SIZE));
+		long num_pages = num_virtual_pages(mm);
+		int huge = checkpoint_get(r, 0, 1);
+		mm->quota = checkpoint_get(r, 0, LONG_MAX);
+		checkpoint_get_stats(r, &mm->stats);
+		struct SharedMapping ** tail = &mm->shared;
+		for(long n = checkpoint_get(r, 0, num_pages); n > 0 && !r->error; n--){
+			struct SharedMapping * mapping = (struct SharedMapping *)malloc(sizeof(struct SharedMapping));
+			mapping->start = checkpoint_get(r, 0, num_pages - 1);
+			mapping->num_pages = checkpoint_get(r, 1, num_pages - mapping->start);
+			mapping->region = checkpoint_get(r, 0, MAX_SHARED_REGIONS - 1);
+			mapping->next = NULL;
+			*tail = mapping;
+			tail = &mapping->next;
+		}
+		// The PTEs are set in the tables they were in: a huge page in place of a last-level table, a page in a table.
+		for(long virtual_page_id = -1; !r->error; ){
+			long distance = checkpoint_get(r, -1, num_pages - virtual_page_id - 2);
+			if(distance == -1)
+				break;
+			virtual_page_id += distance + 1;
+			int pfn = checkpoint_get(r, 0, PTE_PFN_NONE - 1);
+			uint32_t flags = (uint32_t)checkpoint_get(r, 0, UINT32_MAX >> PTE_PFN_BITS) << PTE_PFN_BITS;
+			int pages = (flags & PTE_HUGE) ? HUGE_PAGE_PAGES : 1;
+			void ** slot = table_slot(mm, virtual_page_id, 1);
+			if(pfn + pages > ((flags & PTE_PRESENT) ? num_frames : num_swap_pages) || (*slot != NULL && table_is_huge(*slot))
+			   || ((flags & PTE_HUGE) && (*slot != NULL || virtual_page_id % HUGE_PAGE_PAGES != 0 || virtual_page_id + HUGE_PAGE_PAGES > num_pages))){
+				r->error = 1;
+				break;
+			}
+			if(flags & PTE_HUGE){
+				struct PTE * pte = (struct PTE *)malloc(sizeof(struct PTE));
+				pte_set(pte, pfn, flags);
+				*slot = (void *)((uintptr_t)pte | 1);
+			}
+			else
+				pte_set(pte_walk(mm, virtual_page_id, 1), pfn, flags);
+		}
+		mm->huge = huge;
+	}
+
+	for(int i = 0; i < MAX_SHARED_REGIONS && !r->error; i++){
+		long length = checkpoint_get(r, -1, r->length);
+		if(length == -1)
+			continue;
+		char * name = (char *)malloc(length + 1);
+		checkpoint_get_bytes(r, name, length);
+		name[length] = 0;
+		kernel->shared_regions[i].name = name;
+		kernel->shared_regions[i].refs = checkpoint_get(r, 1, INT_MAX);
+	}
+
+	// Take every page from the buddy allocator, then give back those that were free.
+	pthread_mutex_lock(&kernel->frame_lock);
+	for(int pfn = 0; pfn < num_frames; pfn++){
+		bitmap_set(&kernel->occupied_pages, pfn);
+		kernel->buddy.order[pfn] = -1;
+	}
+	for(int k = 0; k <= BUDDY_MAX_ORDER; k++)
+		kernel->buddy.free_lists[k] = -1;
+	kernel->free_pages = 0;
+	pthread_mutex_unlock(&kernel->frame_lock);
+	for(int end = 0; !r->error; ){
+		int pfn = checkpoint_get(r, -1, num_frames - 1);
+		if(pfn == -1)
+			break;
+		int n = checkpoint_get(r, 1, num_frames - pfn);
+		if(pfn < end)
+			r->error = 1;
+		memset(used + pfn, 1, n);
+		end = pfn + n;
+	}
+	int * pfns = (int *)malloc(sizeof(int) * num_frames);
+	int num_free = 0;
+	for(int pfn = 0; pfn < num_frames; pfn++){
+		if(!used[pfn])
+			pfns[num_free++] = pfn;
+	}
+	free_frames(kernel, pfns, num_free);
+	free(pfns);
+	for(int pfn = 0; pfn < num_frames && !r->error; pfn++){
+		if(!used[pfn])
+			continue;
+		struct LRUEntry * entry = &kernel->lru_entries[pfn];
+		entry->pid = checkpoint_get(r, 0, kernel->num_mm - 1);
+		entry->virtual_page_id = checkpoint_get(r, 0, LONG_MAX);
+		kernel->page_mapcount[pfn] = checkpoint_get(r, 0, INT_MAX);
+		kernel->si->swapper_space[pfn] = checkpoint_get(r, -1, num_swap_pages - 1);
+		struct RMap ** tail = &entry->rmap;
+		for(long n = checkpoint_get(r, 0, INT_MAX); n > 0 && !r->error; n--){
+			struct RMap * rmap = (struct RMap *)malloc(sizeof(struct RMap));
+			rmap->pid = checkpoint_get(r, 0, kernel->num_mm - 1);
+			rmap->virtual_page_id = checkpoint_get(r, 0, LONG_MAX);
+			rmap->next = NULL;
+			*tail = rmap;
+			tail = &rmap->next;
+		}
+	}
+
+	// A page on the queues (or a local list) is mapped by the PTE its LRUEntry names, each one at most once.
+	int queue_ids[] = { QUEUE_RECENT, QUEUE_FREQUENT, QUEUE_GHOST_RECENT, QUEUE_GHOST_FREQUENT };
+	for(int q = 0; q < 4 && !r->error; q++){
+		for(long n = checkpoint_get(r, 0, q < 2 ? num_frames : kernel->ghost_capacity); n > 0 && !r->error; n--){
+			if(q >= 2){
+				int pid = checkpoint_get(r, 0, kernel->num_mm - 1);
+				ghost_add(kernel, queue_ids[q], pid, checkpoint_get(r, 0, LONG_MAX));
+				continue;
+			}
+			int pfn = checkpoint_get(r, 0, num_frames - 1);
+			struct LRUEntry * entry = &kernel->lru_entries[pfn];
+			struct PTE * pte = used[pfn] == 1 && kernel->running[entry->pid] ? pte_walk(&kernel->mm[entry->pid], entry->virtual_page_id, 0) : NULL;
+			if(pte == NULL || !pte_present(pte) || pte_pfn(pte) != pfn){
+				r->error = 1;
+				break;
+			}
+			used[pfn] = 2;
+			entry->queue = queue_ids[q];
+			lru_append(lru_queue(kernel, entry->queue), entry);
+		}
+	}
+	kernel->target_recent = checkpoint_get(r, 0, num_frames);
+	for(int i = 0; i < kernel->num_mm && !r->error; i++){
+		if(!kernel->running[i])
+			continue;
+		for(long n = checkpoint_get(r, 0, num_frames); n > 0 && !r->error; n--){
+			int pfn = checkpoint_get(r, 0, num_frames - 1);
+			struct LRUEntry * entry = &kernel->lru_entries[pfn];
+			struct PTE * pte = used[pfn] == 2 || used[pfn] == 1 ? pte_walk(&kernel->mm[i], entry->virtual_page_id, 0) : NULL;
+			if(entry->pid != i || pte == NULL || !pte_present(pte) || pte_pfn(pte) != pfn){
+				r->error = 1;
+				break;
+			}
+			used[pfn] = 3;
+			charge_add(kernel, entry, entry_pages(kernel, entry));
+		}
+	}
+	free(used);
+
+	char * in_use = (char *)calloc(num_swap_pages, sizeof(char));
+	for(int end = 0; !r->error; ){
+		int i = checkpoint_get(r, -1, num_swap_pages - 1);
+		if(i == -1)
+			break;
+		int n = checkpoint_get(r, 1, num_swap_pages - i);
+		if(i < end)
+			r->error = 1;
+		memset(in_use + i, 1, n);
+		end = i + n;
+	}
+	for(int i = 0; i < num_swap_pages && !r->error; i++){
+		if(!in_use[i])
+			continue;
+		bitmap_set(&kernel->si->swap_map, i);
+		kernel->si->swap_count[i] = checkpoint_get(r, 1, INT_MAX);
+	}
+	free(in_use);
+	while(!r->error){
+		int i = checkpoint_get(r, -1, num_swap_pages - 1);
+		if(i == -1)
+			break;
+		kernel->si->swap_cache[i] = checkpoint_get(r, 0, num_frames - 1);
+	}
+
+	checkpoint_get_stats(r, &kernel->stats);
+}
+
+// Write the content of the swap file pages in use from a checkpoint (3. in the format above) to the swap file, a run
+// at a time. Return 0 when success, -1 when its length does not match the swap file pages in use.
+static int restore_swap_pages(struct Kernel * kernel, const char * pages, size_t length){
+	int num_swap_pages = kernel->si->size / PAGE_SIZE;
+	struct Bitmap * swap_map = &kernel->si->swap_map;
+	size_t num_used = 0;
+	for(int i = 0; i < num_swap_pages; i++)
+		num_used += bitmap_test(swap_map, i);
+	if(num_used * PAGE_SIZE != length)
+		return -1;
+	int batch = min(IOV_MAX, 64);
+	struct iovec * iov = (struct iovec *)malloc(sizeof(struct iovec) * batch);
+	for(int i = 0; i < num_swap_pages; ){
+		int n = 0;
+		while(n < batch && i + n < num_swap_pages && bitmap_test(swap_map, i + n)){
+			iov[n].iov_base = (char *)pages;
+			iov[n].iov_len = PAGE_SIZE;
+			pages += PAGE_SIZE;
+			n++;
+		}
+		if(n == 0){
+			i++;
+			continue;
+		}
+		swap_write_pages(kernel, i, iov, n);
+		i += n;
+	}
+	free(iov);
+	return 0;
+}
+
+struct Kernel * kernel_restore(const char * path){
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+	struct stat st;
+	struct CheckpointHeader header;
+	struct CheckpointHeader expected;
+	long swap_size = SWAP_SPACE_SIZE > 0 ? SWAP_SPACE_SIZE : (MAX_PROCESS_NUM + MAX_SHARED_REGIONS) * VIRTUAL_SPACE_SIZE;
+	checkpoint_header(&expected, swap_size);
+	if(fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+	   || memcmp(&header, &expected, offsetof(struct CheckpointHeader, metadata_offset)) != 0
+	   || header.metadata_offset != sizeof(header) || header.metadata_length > (uint64_t)st.st_size - header.metadata_offset
+	   || header.swap_offset != header.metadata_offset + header.metadata_length
+	   || header.swap_length > (uint64_t)swap_size || header.swap_length % PAGE_SIZE != 0
+	   || header.space_offset % CHECKPOINT_ALIGN != 0 || header.space_offset < header.swap_offset + header.swap_length
+	   || header.space_offset + KERNEL_SPACE_SIZE > (uint64_t)st.st_size){
+		close(fd);
+		return NULL;
+	}
+
+	// The state and the swap file pages are read through a mapping, and checked before anything is built.
+	// kernel-managed memory maps its image.
+	size_t metadata_size = header.swap_offset + header.swap_length;
+	char * metadata = (char *)mmap(NULL, metadata_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	char * space = (char *)mmap(NULL, KERNEL_SPACE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, header.space_offset);
+	close(fd);
+	if(metadata == MAP_FAILED || space == MAP_FAILED || hash_bytes(metadata + header.metadata_offset, header.metadata_length) != header.metadata_hash
+	   || hash_bytes(metadata + header.swap_offset, header.swap_length) != header.swap_hash){
+		if(metadata != MAP_FAILED)
+			munmap(metadata, metadata_size);
+		if(space != MAP_FAILED)
+			munmap(space, KERNEL_SPACE_SIZE);
+		return NULL;
+	}
+
+	struct Kernel * kernel = init_kernel();
+	free(kernel->space);
+	kernel->space = space;
+	kernel->space_mapped = 1;
+
+	// The background reclaim thread waits until the state is rebuilt.
+	pthread_mutex_lock(&kernel->kswapd_lock);
+	struct CheckpointReader reader = { (const unsigned char *)metadata + header.metadata_offset, header.metadata_length, 0, 0 };
+	restore_state(kernel, &reader);
+	if(reader.error || reader.pos != reader.length || restore_swap_pages(kernel, metadata + header.swap_offset, header.swap_length) != 0) {
+		printf("damaged checkpoint %s in kernel_restore\n", path);
+		exit(-1);
+	}
+	pthread_cond_signal(&kernel->kswapd_wait);
+	pthread_mutex_unlock(&kernel->kswapd_lock);
+	munmap(metadata, metadata_size);
+	return kernel;
+}
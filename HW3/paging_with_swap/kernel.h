@@ -1,15 +1,88 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
 extern int KERNEL_SPACE_SIZE;
-extern int VIRTUAL_SPACE_SIZE;
+extern long VIRTUAL_SPACE_SIZE;     // Largest process (bytes), a process may span a 64-bit address space.
 extern int PAGE_SIZE;
 extern int MAX_PROCESS_NUM;
+extern int MAX_SHARED_REGIONS;      // Maximum number of shared regions (vm_map_shared) at a time, 4 by default.
+extern long SWAP_SPACE_SIZE;        // Size of the swap file, 0 ((MAX_PROCESS_NUM + MAX_SHARED_REGIONS) * VIRTUAL_SPACE_SIZE) by default.
+extern int PAGE_REPLACEMENT_POLICY; // One of the POLICY_* values below, read by init_kernel().
+extern const char * SWAP_FILE_PATH; // The swap file created by init_kernel(), "swap" by default.
+extern int SWAP_BACKEND;            // One of the SWAP_BACKEND_* values below, read by init_kernel().
+extern int SWAP_MSYNC_ON_DESTROY;   // With SWAP_BACKEND_MMAP, 1 to msync the swap file in destroy_kernel().
+extern int SWAP_FILE_REUSE;         // 1 to open an existing swap file instead of recreating it (it is resized if needed).
+extern int SWAP_FILE_PREALLOCATE;   // 1 to reserve the disk blocks of the swap file in init_kernel() instead of leaving it sparse.
+extern int SWAP_CLUSTER_SIZE;       // Number of pages lru_add evicts at once when kernel-managed memory is full, 1 by default.
+extern int SWAP_READAHEAD_PAGES;    // Maximum number of pages read ahead on sequential swap-in faults, 0 (disabled) by default.
+extern long ZSWAP_POOL_SIZE;        // Bytes of compressed evicted pages kept in memory in front of the swap file, 0 (disabled) by default.
+extern int RECLAIM_LOW_WATERMARK;   // The background reclaim thread wakes up when fewer pages of kernel-managed memory are free.
+extern int RECLAIM_HIGH_WATERMARK;  // It evicts pages until this many are free. 0 (no background reclaim thread) by default.
+
+// Page replacement policies.
+enum {
+        POLICY_LRU,   // Strict LRU, the default (but for the hits of processes busy in other threads, see LRU_HIT_BATCH).
+        POLICY_CLOCK, // Second chance over the referenced bit in struct PTE, a hit does no list work.
+        POLICY_2Q,    // 2Q: a FIFO (A1in) for pages seen once, an LRU (Am) for pages seen again, and a ghost queue (A1out).
+        POLICY_ARC,   // ARC: balances a recency queue (T1) and a frequency queue (T2) using two ghost queues (B1, B2).
+};
+
+// How pages are moved between kernel-managed memory and the swap file.
+enum {
+        SWAP_BACKEND_FILE, // pread and pwrite on the swap file, the default.
+        SWAP_BACKEND_MMAP, // memcpy to and from a shared mapping of the swap file, no syscall on swap-in or swap-out.
+};
+
+// The queue an LRUEntry is on.
+// The ghost queues remember recently evicted pages (only the pid and the virtual page id) for 2Q and ARC.
+enum {
+        QUEUE_FREQUENT,       // kernel->lru: the LRU queue, the CLOCK ring, Am of 2Q or T2 of ARC.
+        QUEUE_RECENT,         // kernel->lru_recent: A1in of 2Q or T1 of ARC.
+        QUEUE_GHOST_RECENT,   // kernel->ghost_recent: A1out of 2Q or B1 of ARC.
+        QUEUE_GHOST_FREQUENT, // kernel->ghost_frequent: B2 of ARC.
+        QUEUE_PINNED,         // None: the page is pinned by vm_map_span (see page_pins in struct Kernel).
+};
+
+// Number of bits of the virtual page id each level of a page table resolves.
+#define PAGE_TABLE_BITS 9
+#define PAGE_TABLE_ENTRIES (1 << PAGE_TABLE_BITS)
+
+// A huge page maps the pages of a last-level table: HUGE_PAGE_PAGES pages, physically contiguous and aligned, in
+// kernel-managed memory, and consecutive in the swap file.
+#define HUGE_PAGE_ORDER PAGE_TABLE_BITS
+#define HUGE_PAGE_PAGES PAGE_TABLE_ENTRIES
+
+// Number of accesses to resident pages a process batches before reporting them to the page replacement policy.
+// Every batch is reported before a victim is chosen, but those of processes busy in other threads at that moment.
+#define LRU_HIT_BATCH 16
+
+// Size of the translation cache (TLB) of each process: TLB_SETS sets of TLB_WAYS entries, indexed by the virtual page id.
+#define TLB_SETS 16
+#define TLB_WAYS 4
+
+// A (pid, virtual page id) mapping a page of kernel-managed memory besides the one in its LRUEntry.
+struct RMap {
+        int pid;
+        long virtual_page_id;
+        struct RMap * next;
+};
 
 // For simplicity, instead of storing the physical page id, we store the virtual page here.
 // As a result, our LRU will help you manage the page mapping and page swap together.
+// There is one entry per kernel-managed memory page (see lru_entries in struct Kernel), so a resident
+// page finds its entry through the PFN in its PTE instead of searching the list.
 struct LRUEntry {
         int pid;
-        int virtual_page_id;
+        long virtual_page_id;
+        int queue;                   // QUEUE_* value of the queue this entry is on.
         struct LRUEntry * next;
         struct LRUEntry * prev;
+        struct LRUEntry * hash_next; // The next ghost entry in the same bucket of kernel->ghost_hash.
+        struct RMap * rmap;          // The other processes sharing the page (copy-on-write), see page_mapcount in struct Kernel.
+        struct LRUEntry * local_next; // The neighbours of a resident page on the local list of its process (local in struct MMStruct).
+        struct LRUEntry * local_prev;
 };
 
 struct LRU {
@@ -20,82 +93,407 @@ struct LRU {
 
 /*
         Reference: textbook chapter 18.
-        To make it simple, we do not encode PFN and flag bits together to an integer.
-        PTE: page table entry.
-        PFN: page frame number.
+        PTE: page table entry, the PFN and the flag bits encoded together in one 32-bit word (bits).
+        Use the pte_* accessors below instead of the bits.
+        PFN: page frame number, the low PTE_PFN_BITS bits.
                 (1). The page id in kernel-managed memory if present=1.
                 (2). The page id in swap file if present=0.
+                (3). -1 (all PFN bits set) if the mapping for this page is not yet built.
 
         present:
                 (1). present = 0
                         (1.1). If PFN != -1, it means the page is in the swap file.
                         (1.2). If PFN == -1, it means the memory mapping for this page is not yet built.
         dirty: represents if the page in kernel-managed memory is dirty (has been written by some process), 0 -> not dirty, 1 -> dirty. 
-
+        referenced: set to 1 on every access to the page, cleared by POLICY_CLOCK when it gives the page a second chance.
         Currently when the pages are allocated (proc_create_vm), present will be set to 0 and present will be set to 0
         because the translation is not yet built.
         After you access this page (vm_read && vm_write), you will need to either
                 (1) build the translation and present will be set to 1 if the page is currently not present.
                 (2) swap-in the page from swap file if the page is currently present.
+
+        huge: the PTE maps a huge page (HUGE_PAGE_PAGES pages, see proc_create_vm_flags) in place of a last-level table.
+                Its PFN is the first of the pages in kernel-managed memory or in the swap file, the others follow it.
+
+        writable: the process may write the page in place. It is cleared while the page is shared copy-on-write
+        (mapped by several PTEs, or its swap file page is used by other PTEs), and the first write then copies it.
+
+        The flags of a resident page change without lru_lock (dirty and referenced by its process, referenced by
+        POLICY_CLOCK), so the word is read and updated atomically. pte_set() replaces the whole word and is only
+        used while the page is not on the page replacement queues.
 */
+#define PTE_PFN_BITS   27
+#define PTE_PFN_NONE   ((1u << PTE_PFN_BITS) - 1) // PFN -1, also the largest PFN plus one.
+#define PTE_HUGE       (1u << 27)
+#define PTE_WRITABLE   (1u << 28)
+#define PTE_REFERENCED (1u << 29)
+#define PTE_DIRTY      (1u << 30)
+#define PTE_PRESENT    (1u << 31)
+
 struct PTE {
-        int PFN;
-        char present;
-        char dirty;
+        uint32_t bits;
 };
 
+static inline uint32_t pte_bits(const struct PTE * pte){
+        return __atomic_load_n(&pte->bits, __ATOMIC_RELAXED);
+}
+
+static inline int pte_pfn(const struct PTE * pte){
+        uint32_t pfn = pte_bits(pte) & PTE_PFN_NONE;
+        return pfn == PTE_PFN_NONE ? -1 : (int)pfn;
+}
+
+static inline int pte_present(const struct PTE * pte){
+        return (pte_bits(pte) & PTE_PRESENT) != 0;
+}
+
+static inline int pte_dirty(const struct PTE * pte){
+        return (pte_bits(pte) & PTE_DIRTY) != 0;
+}
+
+static inline int pte_referenced(const struct PTE * pte){
+        return (pte_bits(pte) & PTE_REFERENCED) != 0;
+}
+
+// Set the PFN (-1 for none) and the flags (PTE_* bits) of a PTE.
+static inline void pte_set(struct PTE * pte, int pfn, uint32_t flags){
+        __atomic_store_n(&pte->bits, ((uint32_t)pfn & PTE_PFN_NONE) | flags, __ATOMIC_RELAXED);
+}
+
+static inline void pte_set_flags(struct PTE * pte, uint32_t flags){
+        __atomic_fetch_or(&pte->bits, flags, __ATOMIC_RELAXED);
+}
+
+// Clear flags (PTE_* bits) of a PTE and return whether any of them was set.
+static inline int pte_clear_flags(struct PTE * pte, uint32_t flags){
+        return (__atomic_fetch_and(&pte->bits, ~flags, __ATOMIC_RELAXED) & flags) != 0;
+}
+
 /*
         1. The user space and the user space page id start from 0.
         2. size indicates the size of user space (&& kernel-managed memory) allocated for this process.
-        3. page_table is an array of PTE (page table entry).
+        3. page_table is a radix tree of levels levels indexed by the virtual page id, PAGE_TABLE_BITS bits per level.
+           The last level holds arrays of PAGE_TABLE_ENTRIES PTEs (page table entry), the others arrays of PAGE_TABLE_ENTRIES
+           pointers to the next level. A table is allocated when a page under it is first accessed, NULL until then.
+           With huge pages, a last-level table may be replaced by the PTE of a huge page (tagged by the low bit of the pointer).
 */ 
+// An entry of the TLB, caching the PTE of a present virtual page. virtual_page_id is -1 when the entry is empty.
+struct TLBEntry {
+        long virtual_page_id;
+        struct PTE * pte;
+};
+
+// Counters of the kernel (get_kernel_stats) or of a process (get_proc_stats), since init_kernel() or proc_create_vm().
+// The pages of a shared region are counted in its own slot, except for the bytes copied.
+struct PagingStats {
+        long minor_faults;   // Faults served without I/O: a new zero-filled page, or a page in the swap cache.
+        long major_faults;   // Faults reading the swap file (or the zswap pool).
+        long evictions;      // Pages evicted from kernel-managed memory (for a process, those it owned).
+        long write_backs;    // Dirty pages written to the swap file (or the zswap pool).
+        long swap_ins;       // Pages read from the swap file (or the zswap pool), including readahead.
+        long swap_slots;     // Swap file pages in use (for a process, its PTEs holding one).
+        long resident_pages; // Pages of kernel-managed memory in use (for a process, its PTEs mapping one).
+        long bytes_copied;   // Bytes copied by vm_read and vm_write.
+};
+
+// A shared region mapped into a process at virtual pages [start, start + num_pages).
+struct SharedMapping {
+        long start;
+        long num_pages;
+        int region; // Index in shared_regions of struct Kernel.
+        struct SharedMapping * next;
+};
+
 struct MMStruct {
-        int size;
-        struct PTE * page_table;
+        long size;
+        void * page_table;
+        int levels;
+        long last_swap_in;    // The last virtual page brought in from the swap file (including pages read ahead).
+        int readahead_window; // The number of pages read ahead on the next sequential swap-in fault.
+        pthread_mutex_t lock; // Held while the process reads, writes or faults in pages, see struct Kernel.
+        int num_pending_hits; // Accesses to resident pages not yet reported to the page replacement policy.
+        long pending_hits[LRU_HIT_BATCH];
+
+        // Translations of recently accessed present pages. An entry is removed when its page is evicted.
+        struct TLBEntry tlb[TLB_SETS][TLB_WAYS];
+        int tlb_next[TLB_SETS]; // The way of each set replaced next (FIFO).
+        long tlb_hits;
+        long tlb_misses;
+
+        // Counters of the process, updated under its lock (a PTE of the process changes only under it).
+        struct PagingStats stats;
+
+        struct SharedMapping * shared; // The shared regions mapped into the process.
+        int via;                       // For a shared region, the process accessing it (whose lock is also held), -1 if none.
+        int num_spans;                 // Number of spans of the process mapped by vm_map_span and not yet released.
+        int huge;                      // 1 when the process maps its pages with huge pages where it can (VM_HUGE_PAGES).
+
+        // Quota (proc_set_quota): the resident pages whose LRUEntry names the process are charged to it, and kept on
+        // its local list, least recently used first. Under lru_lock, except quota, which is under the lock of the process.
+        long quota;      // Maximum number of pages charged to the process, 0 for no limit.
+        long charged;    // Number of pages of kernel-managed memory charged to the process (a huge page counts all its pages).
+        struct LRU local;
+};
+
+/*
+        A named region of pages shared by the processes mapping it (vm_map_shared). Its pages belong to a hidden process
+        slot of mm (MAX_PROCESS_NUM + its index in shared_regions), so they are paged like the pages of a process, and
+        a process reads and writes them in place through that slot.
+*/
+struct SharedRegion {
+        char * name; // NULL when the region is not used.
+        int refs;    // Number of mappings of the region.
+};
+
+/*
+        A bitmap packed in 64-bit words, bit i is 1 when page i is occupied and 0 when it is free.
+        summary has bit w set when words[w] is full, so finding a free page looks at one summary word per 4096 pages
+        and then at a single word of the bitmap. The padding bits past size are set in both levels.
+*/
+struct Bitmap {
+        int size; // Number of bits.
+        uint64_t * words;
+        uint64_t * summary;
+};
+
+/*
+        A binary buddy allocator over the pages of kernel-managed memory. A free block of order k is 2^k pages starting
+        at a multiple of 2^k, and is on free_lists[k]. A freed block is merged with its buddy (the other half of the
+        block of order k+1 it belongs to) while the buddy is free too, so free pages stay in blocks as large as possible,
+        and a run of 2^k contiguous pages is taken from the first list with a block of order >= k, without a search.
+*/
+#define BUDDY_MAX_ORDER HUGE_PAGE_ORDER
+
+struct BuddyAllocator {
+        int free_lists[BUDDY_MAX_ORDER + 1]; // The first page of the first free block of each order, -1 if none.
+        int * next;                          // For the first page of a free block, the first pages of the next and
+        int * prev;                          // previous free blocks of its order (-1 if none).
+        signed char * order;                 // For each page, the order of the free block it is the first page of, -1 if none.
 };
 
 struct SwapInfoStruct {
-        // An array to indicate the page occupation in swap file, 0 for free, 1 for occupied.
+        // A bitmap to indicate the page occupation in swap file, 0 for free, 1 for occupied.
         // Size = number of swap file pages;
-        char * swap_map;
+        struct Bitmap swap_map;
         // An array to map kernel-managed memory pages to swap file pages.
         // When the element = -1, it means the mapping is not built.
         // Size = number of kernel-managed memory pages.
         int * swapper_space;
+        // For each swap file page, the number of PTEs holding it plus the number of pages of kernel-managed memory
+        // whose swapper_space is it. It is freed in swap_map when this drops to 0.
+        int * swap_count;
+        // For each swap file page, a page of kernel-managed memory holding its content (-1 if none), so that a process
+        // faulting on a swap file page another process already brought in maps that page instead of reading it again.
+        int * swap_cache;
+        // The swap file, opened by init_kernel() and kept open until destroy_kernel().
+        // Pages are read and written with pread and pwrite at offset (swap file page id * PAGE_SIZE),
+        // or copied from and to map (the whole file mapped shared) with SWAP_BACKEND_MMAP.
+        char * path;
+        int fd;
+        char * map;  // NULL with SWAP_BACKEND_FILE.
+        size_t size; // Size of the swap file in bytes.
+        // zswap: the compressed content of each swap file page kept in memory instead of the swap file (NULL if none),
+        // and its length. At most ZSWAP_POOL_SIZE bytes are kept, pages evicted once the pool is full, or that do not
+        // compress, are written to the swap file. The arrays are NULL when ZSWAP_POOL_SIZE is 0.
+        unsigned char ** zswap;
+        int * zswap_length;
+        long zswap_used; // Bytes of the pool in use.
 };
 
+struct ReplacementPolicy;
+
+/*
+        Locking. Each process has its own lock in MMStruct, and the kernel has a lock for each shared structure:
+                lru_lock    the page replacement queues, the ghost queues and the policy state,
+                            page_mapcount, page_pins and the rmap of the LRUEntry of each page.
+                frame_lock  occupied_pages, buddy and free_pages.
+                swap_lock   the swap_map, swap_count, swap_cache and zswap pool of the swap file.
+        A process lock is taken first (a second one only with trylock), then lru_lock, then swap_lock, and frame_lock alone.
+        The exception is a shared region, whose slot is locked after the lock of a process (and shared_lock, if taken):
+        with trylock while other processes map the region, since they may hold it while they fault.
+        A process holds its own lock across the swap I/O of its faults, but no kernel-wide lock, so processes fault in parallel.
+        Evicting a page needs the locks of the processes mapping it: the victims are chosen under lru_lock, their processes
+        are locked with trylock, and a victim whose processes are busy is put back. The PTEs of a process and the
+        swapper_space entries of its resident pages only change under its lock.
+        init_kernel() and destroy_kernel() must not run alongside other kernel functions.
+*/
 struct Kernel {
         char * space;
-        char * occupied_pages;      // For simplicity, we use a char array to indicate the free pages, 0 for free, 1 for occupied.
+        int space_mapped;             // 1 when space is a private mapping of a checkpoint file (kernel_restore).
+        struct Bitmap occupied_pages; // A bitmap to indicate the free pages, 0 for free, 1 for occupied.
+        struct BuddyAllocator buddy;  // The free pages, in blocks.
         struct SwapInfoStruct * si; // The manager for swap space.
         char * running;             // An array marking if the process is running.
-        struct MMStruct * mm;       // An array of MMStruct for each process.
+        struct MMStruct * mm;       // An array of MMStruct for each process, followed by one for each shared region.
+        int num_mm;                 // MAX_PROCESS_NUM + MAX_SHARED_REGIONS.
+        struct SharedRegion * shared_regions;
+        pthread_mutex_t shared_lock; // shared_regions.
         struct LRU lru;
+        struct LRUEntry * lru_entries; // An array of LRUEntry indexed by PFN, the entry of the page held in each kernel-managed memory page.
+        int * page_mapcount;           // Number of PTEs mapping each kernel-managed memory page (its LRUEntry and its rmap).
+        int * page_pins;               // Number of spans (vm_map_span) pinning each kernel-managed memory page, off the queues while > 0.
+        int pinned_pages;              // Sum of page_pins, under lru_lock.
+
+        // Page replacement, see the POLICY_* and QUEUE_* values.
+        const struct ReplacementPolicy * policy;
+        struct LRU lru_recent;
+        struct LRU ghost_recent;
+        struct LRU ghost_frequent;
+        struct LRUEntry * ghost_entries;   // A pool of entries for the ghost queues.
+        struct LRUEntry * ghost_free;      // Free entries of the pool, chained by next.
+        struct LRUEntry ** ghost_hash;     // Hash table over (pid, virtual_page_id) of the ghost entries.
+        int ghost_capacity;                // Size of the pool and of the hash table.
+        int target_recent;                 // ARC: the adaptive target size of T1. 2Q: the maximum size of A1in.
+
+        pthread_mutex_t lru_lock;
+        pthread_mutex_t frame_lock;
+        pthread_mutex_t swap_lock;
+        int free_pages;                    // Number of zero bits in occupied_pages.
+
+        // The background reclaim thread (kswapd).
+        pthread_mutex_t kswapd_lock;
+        pthread_cond_t kswapd_wait;        // Signaled when free pages drop below low_watermark.
+        pthread_t kswapd;
+        int kswapd_running;                // 1 while the background reclaim thread runs, cleared to stop it.
+        int low_watermark;                 // RECLAIM_LOW_WATERMARK and RECLAIM_HIGH_WATERMARK, capped by the number of pages.
+        int high_watermark;
+
+        // The accesses (vm_read and the others through vm_copy, vm_map_span and lru_add) and kernel_checkpoint().
+        // An access may wait for reclaim to free a page while it holds the lock of its process, so a checkpoint lets
+        // the running ones finish, and holds new ones back, before it locks every process.
+        pthread_mutex_t checkpoint_lock;
+        pthread_cond_t checkpoint_wait;    // Signaled when running_accesses drops to 0, and when a checkpoint is done.
+        int checkpointing;                 // 1 while kernel_checkpoint() runs, new accesses wait for it to be done.
+        int running_accesses;
+
+        // Counters since init_kernel(), updated with atomic adds so get_kernel_stats() reads them without a lock.
+        // resident_pages is not kept, it is derived from free_pages.
+        struct PagingStats stats;
 };
 
 struct Kernel * init_kernel();
 void destroy_kernel(struct Kernel * kernel);
+
+/*
+        Write the state of the kernel to the file path: the processes and shared regions with their page tables, the
+        page replacement queues in order (with the ghost queues), the use of the swap file (swap_map, swap_count,
+        swapper_space and swap_cache), the content of the swap file pages in use (from the zswap pool or the swap file),
+        and the pages of kernel-managed memory in use. The checkpoint does not depend on the swap file, so the kernel
+        keeps running and may be checkpointed again, and the checkpoint may be restored any number of times.
+        It waits for the accesses running in other threads (vm_read and the like) to finish, and new ones wait for it.
+        The checkpoint is written next to path and renamed over it once complete.
+        Return 0 when success, -1 when failure (a span is mapped by vm_map_span, or the file cannot be written).
+*/
+int kernel_checkpoint(struct Kernel * kernel, const char * path);
+
+/*
+        Create a kernel from a checkpoint of kernel_checkpoint(), in place of init_kernel(). KERNEL_SPACE_SIZE, PAGE_SIZE,
+        VIRTUAL_SPACE_SIZE, MAX_PROCESS_NUM, MAX_SHARED_REGIONS, SWAP_SPACE_SIZE and PAGE_REPLACEMENT_POLICY must be those
+        of the checkpoint, the other settings are read like init_kernel() does, which creates the swap file at
+        SWAP_FILE_PATH. The version, the configuration and checksums of the state and of the swap file pages are checked,
+        the state is rebuilt and the swap file pages in use are written to the swap file, but the pages of
+        kernel-managed memory are not read: space is a private mapping of the file, paged in as it is accessed, and the
+        file must not change while it is used.
+        Return NULL when the file cannot be read, or is of another version or configuration, or damaged (a state that
+        passes the checksum but does not hold together exits).
+*/
+struct Kernel * kernel_restore(const char * path);
 void print_kernel_free_space(struct Kernel * kernel);                // Print the free kernel space.
 void print_kernel_lru(struct Kernel * kernel);                       // Print lru information.
 void get_kernel_free_space_info(struct Kernel * kernel, char * buf); // Copy the free kernel free space information to buf.
 void get_kernel_lru_info(struct Kernel * kernel, char * buf);        // Copy lru information to buf.
 void print_memory_mappings(struct Kernel * kernel, int pid);         // Print memory mappings for a specific process.
 
-// Pop the head of the LRU.
+// Copy the number of TLB hits and misses of a process (since proc_create_vm) to hits and misses.
+// Return 0 when success, -1 when failure (the process is not running).
+int get_tlb_info(struct Kernel * kernel, int pid, long * hits, long * misses);
+
+// Copy the counters of the kernel to stats, without printing or taking a lock other than frame_lock.
+void get_kernel_stats(struct Kernel * kernel, struct PagingStats * stats);
+
+// Copy the counters of a process to stats. Return 0 when success, -1 when failure (the process is not running).
+int get_proc_stats(struct Kernel * kernel, int pid, struct PagingStats * stats);
+
+// Evict the page chosen by the page replacement policy (the head of the LRU for POLICY_LRU).
 void lru_del(struct Kernel * kernel);
 
+// Evict up to num_pages pages chosen by the page replacement policy, and return how many were evicted.
+// The pages that need a new swap file page get consecutive ones when possible, and the pages
+// written back are written with one vectored write per run of consecutive swap file pages.
+int lru_reclaim(struct Kernel * kernel, int num_pages);
+
 // Add an page to LRU (pass the pid and the virtual page id).
 //      1. If the entry is already in the LRU, move it to the tail.
 //      2. If the entry is not in the LRU, append it to the tail.
-void lru_add(struct Kernel * kernel, int pid, int virtual_page_id);
+// Other policies update their own queues instead, see the POLICY_* values.
+void lru_add(struct Kernel * kernel, int pid, long virtual_page_id);
 
 /*
         1. Check if there's a not-occupied process slot.
-        2. Alloc space for page_table (the size of it depends on how many pages you need).
-        3. The mapping to kernel-managed memory is not built, present bit and dirty bit are set to 0, PFN is set to -1.
+        2. Set up an empty page_table (the number of levels depends on how many pages you need).
+        3. The mapping to kernel-managed memory is not built, the tables of page_table are allocated when pages are first accessed.
         Return a pid (the index in MMStruct array) which is >= 0 when success, -1 when failure.
 */
-int proc_create_vm(struct Kernel * kernel, int size);
+int proc_create_vm(struct Kernel * kernel, long size);
+
+// Flags of proc_create_vm_flags.
+enum {
+        VM_HUGE_PAGES = 1, // Map each aligned block of HUGE_PAGE_PAGES pages of the process with a huge page when possible.
+};
+
+/*
+        proc_create_vm with flags (VM_* values). With VM_HUGE_PAGES, the first access to a block of HUGE_PAGE_PAGES pages
+        within the process maps the whole block with one PTE and one LRUEntry, to a block of contiguous pages of
+        kernel-managed memory. It is evicted and read back as a whole, in one write and one read of consecutive swap file
+        pages. When no such block is free (even after evicting pages), or no run of swap file pages is, the huge page is
+        split into pages. So it is by proc_fork_vm, vm_map_shared over it, and vm_map_span over it. A block that only partly
+        fits in the process, and every page of a shared region, uses pages.
+        Return a pid which is >= 0 when success, -1 when failure.
+*/
+int proc_create_vm_flags(struct Kernel * kernel, long size, int flags);
+
+/*
+        Limit the resident pages of process pid to num_pages pages of kernel-managed memory (0 for no limit, the default),
+        like a memory cgroup. A page is charged to the process its LRUEntry names: the one that faulted it in, until
+        that one stops mapping it. A process at its quota evicts its own pages to fault in new ones, the least recently
+        used first (a page referenced since it was last passed over gets a second chance), before kernel-managed memory
+        runs out and the page replacement policy evicts the pages of any process. Lowering the quota of a process below
+        its pages evicts the pages over it. A process may stay above its quota when its pages are pinned (vm_map_span),
+        and a child of proc_fork_vm has the quota of its parent.
+        Return 0 when success, -1 when failure (invalid pid, or the process is not running).
+*/
+int proc_set_quota(struct Kernel * kernel, int pid, long num_pages);
+
+/*
+        Create a copy of process pid (fork) in a not-occupied process slot.
+        The child maps the same pages of kernel-managed memory and the same swap file pages as the parent, and both lose
+        write access to the present ones. A page is copied when either process first writes it (copy-on-write).
+        Return the pid of the child when success, -1 when failure (invalid pid, no free process slot, or spans of vm_map_span).
+*/
+int proc_fork_vm(struct Kernel * kernel, int pid);
+
+/*
+        Map the shared region called name at [addr, addr+size) of the user space of process pid. The region is created
+        with this size when it does not exist, and otherwise must be at least this large. Writes through one mapping are
+        seen by every process mapping the region. The previous content of the range is discarded.
+        addr must be page aligned, and the range must be within the user space and not overlap another shared region.
+        Return 0 when success, -1 when failure.
+*/
+int vm_map_shared(struct Kernel * kernel, int pid, const char * name, char * addr, long size);
+
+/*
+        Unmap the shared region mapped at addr of process pid, the range reads as zero again.
+        A region is removed, with its pages, when nothing maps it any more (proc_exit_vm unmaps every region).
+        Return 0 when success, -1 when failure.
+*/
+int vm_unmap_shared(struct Kernel * kernel, int pid, char * addr);
+
+/*
+        Same-page merging: compare the content of the resident pages, and share identical pages copy-on-write
+        (see proc_fork_vm), freeing the copies. Pages whose processes are busy in other threads are skipped.
+        Return the number of pages freed.
+*/
+int ksm_scan(struct Kernel * kernel);
 
 /*
         This function will read the range [addr, addr+size) from user space of a specific process to the buf (buf should be >= size).
@@ -116,9 +514,43 @@ int vm_read(struct Kernel * kernel, int pid, char * addr, int size, char * buf);
 int vm_write(struct Kernel * kernel, int pid, char * addr, int size, char * buf);
 
 /*
-        1. Check if the pid is valid.
-        2. Iterate the LRU queue to delete those active pages of this process.
-        3. Iterate the page_table in MMStruct.
+        Vectored vm_read and vm_write: read the segments iov[0], ..., iov[iovcnt-1] of the user space of process pid
+        (iov_base is the address and iov_len the size of each) one after the other to buf, or write them from buf.
+        1. Check if the pid is valid and if every segment is within the user space, before copying anything.
+        2. Map the pages of the segments in one pass: a fault also brings in the other pages the call accesses next
+           that are not resident (up to a quarter of kernel-managed memory), reading consecutive swap file pages at once.
+        3. Copy the content.
+        Return 0 when success, -1 when failure (out of bounds).
+*/
+int vm_readv(struct Kernel * kernel, int pid, const struct iovec * iov, int iovcnt, char * buf);
+int vm_writev(struct Kernel * kernel, int pid, const struct iovec * iov, int iovcnt, char * buf);
+
+// A range of the user space of a process mapped by vm_map_span. iov[i] is the part of the range in its i-th page,
+// pointing into kernel->space, and pfns[i] that page.
+struct VMSpan {
+        int pid;
+        int num_pages;
+        struct iovec * iov;
+        int * pfns;
+};
+
+/*
+        Map the range [addr, addr+size) of the user space of process pid for direct access, without copying it.
+        Its pages are mapped like vm_readv, made private to the process (a page shared copy-on-write is copied), and pinned:
+        they are not evicted (nor merged by ksm_scan) until vm_unmap_span, so span->iov stays valid.
+        With write = 1 the pages are also marked dirty, and the caller may write through span->iov.
+        While a process has spans, proc_fork_vm, proc_exit_vm, vm_map_shared and vm_unmap_shared fail for it.
+        Return 0 when success, -1 when failure (out of bounds, or more than half of kernel-managed memory would be pinned).
+*/
+int vm_map_span(struct Kernel * kernel, int pid, char * addr, int size, int write, struct VMSpan * span);
+
+// Unpin the pages of a span mapped by vm_map_span, and free span->iov and span->pfns.
+void vm_unmap_span(struct Kernel * kernel, struct VMSpan * span);
+
+/*
+        1. Check if the pid is valid, and that the process has no spans mapped by vm_map_span.
+        2. Delete those active pages of this process from the LRU queue.
+        3. Iterate the page_table in MMStruct (until the pages of the process are all released).
                 3.1. Update occupied_pages and swapper_space if present=1.
                 3.2. Update swap_map if present=0 and PFN!=-1.
         Return 0 when success, -1 when failure.